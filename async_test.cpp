@@ -0,0 +1,69 @@
+/*
+ * Tests for the C++20 coroutine layer.
+ * Written by Edward Lu
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+#include "mqtt.hpp"
+
+#define FLOWS       8
+#define MSGS        16
+
+static int acked = 0;
+static int received = 0;
+
+static void stop_when_done(mqtt::event_loop &loop) {
+    if (acked == FLOWS * MSGS && received == FLOWS * MSGS)
+        loop.stop();
+}
+
+static mqtt::task<void> publisher(mqtt::client &c, mqtt::event_loop &loop,
+                                  int flow) {
+    for (int i = 0; i < MSGS; i++) {
+        mqtt_qos_t qos = (i % 2 == 0) ? QOS1 : QOS2;
+        int ret = co_await c.publish("tests/async/" + std::to_string(flow),
+                                     std::to_string(i), qos);
+        assert(ret >= 0);
+        acked++;
+    }
+    stop_when_done(loop);
+}
+
+static mqtt::task<void> consumer(mqtt::client &c, mqtt::event_loop &loop) {
+    auto messages = c.messages();
+
+    while (auto msg = co_await messages.next()) {
+        assert(msg->topic.rfind("tests/async/", 0) == 0);
+        if (++received == FLOWS * MSGS)
+            break;
+    }
+    stop_when_done(loop);
+}
+
+static mqtt::task<void> run(mqtt::client &c, mqtt::event_loop &loop) {
+    assert(co_await c.subscribe("tests/async/+", QOS1) == QOS1);
+    assert(co_await c.ping() >= 0);
+
+    mqtt::spawn(consumer(c, loop));
+    for (int flow = 0; flow < FLOWS; flow++)
+        mqtt::spawn(publisher(c, loop, flow));
+}
+
+int main(void) {
+    mqtt::client c("test.mosquitto.org", "this_is_an_async_test", 1883);
+    mqtt::event_loop loop;
+
+    loop.add(c);
+    mqtt::spawn(run(c, loop));
+    loop.run();
+
+    assert(acked == FLOWS * MSGS);
+    assert(received == FLOWS * MSGS);
+
+    printf("All Tests Passed!\n");
+
+    return 0;
+}
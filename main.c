@@ -7,18 +7,232 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <sys/time.h>
+#include <netinet/in.h>
 
 #include "mqtt.h"
+#include "mqtt_mux.h"
+#include "mqtt_capture.h"
+#include "mqtt_cluster.h"
+
+static int async_acks = 0;
+static int async_msgs = 0;
+
+static void on_async_msg(mqtt_broker *broker, const mqtt_data_t *data,
+                         void *arg) {
+    if (strncmp(data->topic, "tests/async", strlen("tests/async")) == 0)
+        async_msgs++;
+}
+
+static void on_async_ack(mqtt_broker *broker, control_packet_t type,
+                         uint16_t packet_id, int status, void *arg) {
+    assert(status != FAILURE);
+    async_acks++;
+}
+
+static long live_blocks = 0;
+
+static void *count_malloc(size_t size) {
+    void *ptr = malloc(size);
+
+    if (ptr != NULL)
+        live_blocks++;
+    return ptr;
+}
+
+static void *count_realloc(void *ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+static void count_free(void *ptr) {
+    if (ptr != NULL)
+        live_blocks--;
+    free(ptr);
+}
+
+static int disc_msgs = 0;
+
+static void on_disc_msg(mqtt_broker *broker, const mqtt_data_t *data,
+                        void *arg) {
+    disc_msgs++;
+    assert(mqtt_disconnect(broker) >= 0);
+}
+
+static int pub_acks = 0;
+
+static void on_pub_ack(mqtt_broker *broker, control_packet_t type,
+                       uint16_t packet_id, int status, void *arg) {
+    pub_acks++;
+}
+
+static atomic_bool mux_stop = false;
+
+static void *run_mux(void *arg) {
+    while (!atomic_load(&mux_stop))
+        assert(mqtt_mux_run_once((mqtt_mux *)arg, 10) >= 0);
+    return NULL;
+}
+
+static int water_calls = 0;
+static bool water_above = false;
+static size_t water_queued = 0;
+
+static void on_water(mqtt_broker *broker, bool above, size_t queued,
+                     void *arg) {
+    water_calls++;
+    water_above = above;
+    water_queued = queued;
+}
+
+/*
+ * Connects to a broker played by the test on a loopback socket, which only
+ * reads what the client sent when drain_peer is called. Returns the peer.
+ */
+static mqtt_broker *loop_connect(const char *client_id, int *peer) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addr_len = sizeof(addr);
+    const char connack[] = { CONNACK << 4, 2, 0, 0 };
+    int listen_fd, buf_len = 4096;
+    mqtt_broker *broker;
+    char connect[64];
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(listen_fd >= 0);
+    assert(bind(listen_fd, (struct sockaddr *)&addr, addr_len) >= 0);
+    assert(listen(listen_fd, 1) >= 0);
+    assert(getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) >= 0);
+
+    broker = mqtt_init("127.0.0.1", client_id, ntohs(addr.sin_port));
+    assert(broker != NULL);
+    assert((*peer = accept(listen_fd, NULL, NULL)) >= 0);
+    close(listen_fd);
+
+    // small socket buffers, so the client queues after a few packets
+    assert(setsockopt(*peer, SOL_SOCKET, SO_RCVBUF, &buf_len,
+                      sizeof(buf_len)) >= 0);
+    assert(setsockopt(broker->socket_fd, SOL_SOCKET, SO_SNDBUF, &buf_len,
+                      sizeof(buf_len)) >= 0);
+
+    assert(write(*peer, connack, sizeof(connack)) == sizeof(connack));
+    assert(mqtt_connect(broker, CLEAN_SESSION, 60U) >= 0);
+    assert(read(*peer, connect, sizeof(connect)) > 0);
+
+    return broker;
+}
+
+/*
+ * Reads everything the client sent to the loopback peer so far, keeping the
+ * first len bytes in buf. Returns number of bytes read.
+ */
+static size_t drain_peer(int peer, char *buf, size_t len) {
+    size_t total = 0;
+    ssize_t ret;
+    char junk[4096];
+
+    for (;;) {
+        if (total < len)
+            ret = recv(peer, &buf[total], len - total, MSG_DONTWAIT);
+        else
+            ret = recv(peer, junk, sizeof(junk), MSG_DONTWAIT);
+        if (ret <= 0)
+            break;
+        total += ret;
+    }
+
+    return total;
+}
+
+/*
+ * Builds a QoS 0 PUBLISH for the loopback peer to send, returns its length
+ */
+static size_t build_publish(char *buf, const char *topic, const char *msg) {
+    size_t topic_len = strlen(topic), msg_len = strlen(msg);
+
+    buf[0] = PUBLISH << 4;
+    buf[1] = 2 + topic_len + msg_len;  // short enough for one length byte
+    buf[2] = 0;
+    buf[3] = topic_len;
+    memcpy(&buf[4], topic, topic_len);
+    memcpy(&buf[4 + topic_len], msg, msg_len);
+
+    return 4 + topic_len + msg_len;
+}
+
+/*
+ * Index of the PUBLISH to topic among the packets in buf, -1 if not found
+ */
+static int find_publish(const char *buf, size_t len, const char *topic) {
+    size_t off = 0, topic_len = strlen(topic);
+    int idx = 0;
+
+    while (off + 2 <= len) {
+        size_t remaining = 0, shift = 0, hdr = 1;
+
+        do {
+            remaining |= (size_t)(buf[off + hdr] & 0x7f) << shift;
+            shift += 7;
+        } while (buf[off + hdr++] & 0x80);
+
+        if (((uint8_t)buf[off] >> 4) == PUBLISH &&
+            ((uint8_t)buf[off + hdr] << 8 | (uint8_t)buf[off + hdr + 1]) ==
+            topic_len &&
+            strncmp(&buf[off + hdr + 2], topic, topic_len) == 0) {
+            return idx;
+        }
+
+        off += hdr + remaining;
+        idx++;
+    }
+
+    return -1;
+}
 
 int main(void) {
-    mqtt_data_t *mqtt_data;
+    mqtt_data_t mqtt_data;
     int recv_len;
     mqtt_broker *broker;
+    mqtt_mux *mux;
+    pthread_t mux_owner;
+    mqtt_mux_client *mux_client, *mux_client2;
+    mqtt_data_t mux_data, last_data;
+    mqtt_capture *cap;
+    mqtt_pool *pool;
+    mqtt_broker *pooled, *publisher;
+    mqtt_cluster *cluster;
+    FILE *file;
+    struct timeval tv;
+    socklen_t tv_len;
+    const capture_rec *rec;
+    size_t cap_off = 0;
+    void *block;
+    char long_host[HOSTNAME_LEN + 1];
+    mqtt_broker *loop;
+    int peer, ret;
+    char big_msg[1024], num[16];
+    static char sent[131072];
+    size_t sent_len, got, pkt_len;
+    char pkt[2 * 64];
+    long blocks;
+
+    // the allocator can't change while memory from it is live
+    block = mqtt_malloc(16);
+    assert(block != NULL);
+    assert(mqtt_set_allocator(malloc, realloc, free) < 0);
+    mqtt_free(block);
+    assert(mqtt_set_allocator(count_malloc, count_realloc, count_free) >= 0);
 
     broker = mqtt_init("test.mosquitto.org", "this_is_a_test", 1883);
     assert(broker != NULL);
+    assert(mqtt_cache_enable(broker, 16) >= 0);
+    assert(mqtt_capture_start(broker, "mqtt_test.cap") >= 0);
 
     assert(mqtt_connect(broker, CLEAN_SESSION, 60U) >= 0);
+    assert(mqtt_set_low_latency(broker, -1) < 0);
+    assert(mqtt_set_low_latency(broker, 20) >= 0);
 
 
     assert(mqtt_pub(broker, "tests/test1", "msg1", true, false, QOS0) >= 0);
@@ -26,38 +240,350 @@ int main(void) {
     assert(mqtt_pub(broker, "tests/test3", "msg3", true, false, QOS2) >= 0);
 
     assert(mqtt_sub(broker, "tests/test1", QOS0) >= 0);
-    recv_len = mqtt_get_data(broker, mqtt_data);
+    recv_len = mqtt_get_data(broker, &mqtt_data);
     assert(recv_len >= 0);
-    assert(mqtt_data->qos == QOS0);
-    assert(mqtt_data->msg_id == -1);
-    assert(strcmp(mqtt_data->topic, "tests/test1") == 0);
-    assert(mqtt_data->payload_len == strlen("msg1"));
-    assert(strncmp(mqtt_data->payload, "msg1", strlen("msg1")) == 0);
+    assert(mqtt_data.qos == QOS0);
+    assert(mqtt_data.msg_id == -1);
+    assert(strcmp(mqtt_data.topic, "tests/test1") == 0);
+    assert(mqtt_data.payload_len == strlen("msg1"));
+    assert(strncmp(mqtt_data.payload, "msg1", strlen("msg1")) == 0);
+
+    assert(mqtt_get_last(broker, "tests/test1", &last_data) >= 0);
+    assert(last_data.payload_len == strlen("msg1"));
+    assert(strncmp(last_data.payload, "msg1", strlen("msg1")) == 0);
+    assert(mqtt_get_last(broker, "tests/test4", &last_data) < 0);
+
+    // already subscribed, retained value is served from the cache
+    assert(mqtt_sub(broker, "tests/test1", QOS0) >= 0);
+    assert(mqtt_data_pending(broker));
+    assert(mqtt_get_data(broker, &mqtt_data) == recv_len);
+    assert(strcmp(mqtt_data.topic, "tests/test1") == 0);
+    assert(mqtt_data.retain);
+    assert(strncmp(mqtt_data.payload, "msg1", strlen("msg1")) == 0);
+
+    // a live message may have replaced the retained value, which then comes
+    // from the broker again
+    assert(mqtt_pub(broker, "tests/test1", "live1", false, false, QOS0) >= 0);
+    assert(mqtt_get_data(broker, &mqtt_data) >= 0);
+    assert(!mqtt_data.retain);
+    assert(strncmp(mqtt_data.payload, "live1", strlen("live1")) == 0);
+    assert(mqtt_sub(broker, "tests/test1", QOS0) >= 0);
+    assert(!mqtt_data_pending(broker));
+    assert(mqtt_get_data(broker, &mqtt_data) >= 0);
+    assert(mqtt_data.retain);
+    assert(strncmp(mqtt_data.payload, "msg1", strlen("msg1")) == 0);
+    assert(mqtt_sub(broker, "tests/test1", QOS0) >= 0);
+    assert(mqtt_data_pending(broker));
+    assert(mqtt_get_data(broker, &mqtt_data) >= 0);
+
+    // an empty retained message clears the topic
+    assert(mqtt_pub(broker, "tests/test4", "msg4", true, false, QOS0) >= 0);
+    assert(mqtt_sub(broker, "tests/test4", QOS0) >= 0);
+    assert(mqtt_get_data(broker, &mqtt_data) >= 0);
+    assert(mqtt_get_last(broker, "tests/test4", &last_data) >= 0);
+    assert(mqtt_pub(broker, "tests/test4", "", true, false, QOS0) >= 0);
+    assert(mqtt_get_data(broker, &mqtt_data) >= 0);
+    assert(mqtt_data.payload_len == 0);
+    assert(mqtt_get_last(broker, "tests/test4", &last_data) < 0);
+    assert(mqtt_unsub(broker, "tests/test4") >= 0);
 
     assert(mqtt_ping(broker) >= 0);
 
     assert(mqtt_sub(broker, "tests/test2", QOS1) >= 0);
-    recv_len = mqtt_get_data(broker, mqtt_data);
+    recv_len = mqtt_get_data(broker, &mqtt_data);
     assert(recv_len >= 0);
-    assert(mqtt_data->qos == QOS1);
-    assert(mqtt_data->msg_id == 1);
-    assert(strcmp(mqtt_data->topic, "tests/test2") == 0);
-    assert(mqtt_data->payload_len == strlen("msg2"));
-    assert(strncmp(mqtt_data->payload, "msg2", strlen("msg2")) == 0);
+    assert(mqtt_data.qos == QOS1);
+    assert(mqtt_data.msg_id == 1);
+    assert(strcmp(mqtt_data.topic, "tests/test2") == 0);
+    assert(mqtt_data.payload_len == strlen("msg2"));
+    assert(strncmp(mqtt_data.payload, "msg2", strlen("msg2")) == 0);
 
     assert(mqtt_sub(broker, "tests/test3", QOS2) >= 0);
-    recv_len = mqtt_get_data(broker, mqtt_data);
+    recv_len = mqtt_get_data(broker, &mqtt_data);
     assert(recv_len >= 0);
-    assert(mqtt_data->qos == QOS2);
-    assert(mqtt_data->msg_id == 2);
-    assert(strcmp(mqtt_data->topic, "tests/test3") == 0);
-    assert(mqtt_data->payload_len == strlen("msg3"));
-    assert(strncmp(mqtt_data->payload, "msg3", strlen("msg3")) == 0);
+    assert(mqtt_data.qos == QOS2);
+    assert(mqtt_data.msg_id == 2);
+    assert(strcmp(mqtt_data.topic, "tests/test3") == 0);
+    assert(mqtt_data.payload_len == strlen("msg3"));
+    assert(strncmp(mqtt_data.payload, "msg3", strlen("msg3")) == 0);
+
+    // the owner runs in a thread, requests wait for its replies
+    mux = mqtt_mux_create("/mqtt_test", broker);
+    assert(mux != NULL);
+    assert(pthread_create(&mux_owner, NULL, run_mux, mux) == 0);
+    mux_client = mqtt_mux_attach("/mqtt_test");
+    assert(mux_client != NULL);
+    assert(mqtt_mux_sub(mux_client, "tests/test1", QOS0) >= 0);
+    assert(mqtt_mux_get_data(mux_client, &mux_data) >= 0);
+    assert(strcmp(mux_data.topic, "tests/test1") == 0);
+    assert(mux_data.retain);
+    assert(mux_data.payload_len == strlen("msg1"));
+    assert(strncmp(mux_data.payload, "msg1", strlen("msg1")) == 0);
+
+    // a second client of the filter gets the retained value from the cache,
+    // the first one doesn't get it again
+    mux_client2 = mqtt_mux_attach("/mqtt_test");
+    assert(mux_client2 != NULL);
+    assert(mqtt_mux_sub(mux_client2, "tests/test1", QOS0) >= 0);
+    assert(mqtt_mux_get_data(mux_client2, &mux_data) >= 0);
+    assert(mux_data.retain);
+    assert(strncmp(mux_data.payload, "msg1", strlen("msg1")) == 0);
+    assert(mux_client->slot->to_client.head ==
+           mux_client->slot->to_client.tail);
+
+    // a client behind on QoS 1 messages gets them later, QoS 0 ones are lost
+    assert(mqtt_mux_sub(mux_client, "tests/mux_backlog", QOS1) >= 0);
+    assert(mqtt_mux_sub(mux_client2, "tests/mux_backlog", QOS0) >= 0);
+    publisher = mqtt_init("test.mosquitto.org", "this_is_a_pub", 1883);
+    assert(publisher != NULL);
+    assert(mqtt_connect(publisher, CLEAN_SESSION, 60) >= 0);
+    assert(mqtt_set_callbacks(publisher, NULL, on_pub_ack, NULL) >= 0);
+    for (int i = 0; i < 2 * MUX_RING_SLOTS; i++) {
+        snprintf(num, sizeof(num), "%d", i);
+        assert(mqtt_pub_async(publisher, "tests/mux_backlog", num, false, false,
+                              QOS1) > 0);
+    }
+    while (pub_acks < 2 * MUX_RING_SLOTS)
+        assert(mqtt_poll(publisher, 1000) >= 0);
+    assert(mqtt_disconnect(publisher) >= 0);
+    assert(free_broker(publisher) >= 0);
+    for (int i = 0; i < 10000 && mux_client2->slot->dropped < MUX_RING_SLOTS;
+         i++)
+        usleep(1000);
+    for (int i = 0; i < 2 * MUX_RING_SLOTS; i++) {
+        assert(mqtt_mux_get_data(mux_client, &mux_data) >= 0);
+        snprintf(num, sizeof(num), "%d", i);
+        assert(mux_data.qos == QOS1 && mux_data.payload_len == strlen(num));
+        assert(strncmp(mux_data.payload, num, strlen(num)) == 0);
+    }
+    for (int i = 0; i < MUX_RING_SLOTS; i++)
+        assert(mqtt_mux_get_data(mux_client2, &mux_data) >= 0);
+    assert(mqtt_mux_dropped(mux_client) == 0);
+    assert(mqtt_mux_dropped(mux_client2) == MUX_RING_SLOTS);
+    assert(mqtt_mux_dropped(mux_client2) == 0);
+
+    // results come from the broker, or the owner when it refuses
+    assert(mqtt_mux_pub(mux_client2, "tests/mux_pub", "msg19", false, false,
+                        QOS2) >= 0);
+    for (int i = 2; i < MUX_MAX_SUBS; i++) {
+        snprintf(num, sizeof(num), "tests/mux%d", i);
+        assert(mqtt_mux_sub(mux_client2, num, QOS0) >= 0);
+    }
+    assert(mqtt_mux_sub(mux_client2, "tests/mux_full", QOS0) < 0);
+    assert(mqtt_mux_unsub(mux_client2, "tests/mux2") >= 0);
+    assert(mqtt_mux_sub(mux_client2, "tests/mux_full", QOS0) >= 0);
+
+    atomic_store(&mux_stop, true);
+    assert(pthread_join(mux_owner, NULL) == 0);
+    assert(mqtt_mux_detach(mux_client2) >= 0);
+    assert(mqtt_mux_detach(mux_client) >= 0);
+    assert(mqtt_mux_run_once(mux, 0) >= 0);
+    assert(mqtt_mux_destroy(mux) >= 0);
 
     assert(mqtt_unsub(broker, "tests/test1") >= 0);
     assert(mqtt_unsub(broker, "tests/test2") >= 0);
     assert(mqtt_unsub(broker, "tests/test3") >= 0);
 
+    // SUBACK, PUBACK, PUBCOMP, PINGRESP, UNSUBACK + 2 messages
+    assert(mqtt_set_callbacks(broker, on_async_msg, on_async_ack, NULL) >= 0);
+    assert(mqtt_sub_async(broker, "tests/async", QOS1) > 0);
+    assert(mqtt_pub_async(broker, "tests/async", "msg4", false, false,
+                          QOS1) > 0);
+    assert(mqtt_pub_async(broker, "tests/async", "msg5", false, false,
+                          QOS2) > 0);
+    assert(mqtt_ping_async(broker) >= 0);
+    while (async_acks < 4 || async_msgs < 2)
+        assert(mqtt_poll(broker, 1000) >= 0);
+    assert(mqtt_unsub_async(broker, "tests/async") > 0);
+    while (async_acks < 5)
+        assert(mqtt_poll(broker, 1000) >= 0);
+
+    // one message burst, then the topic is rate limited
+    assert(mqtt_set_rate_limit(broker, "tests/limited/#", 0.1, 1) >= 0);
+    assert(mqtt_set_backpressure(broker, 65536, 32768, 16384,
+                                 NULL, NULL) >= 0);
+    assert(mqtt_pub_async(broker, "tests/limited/a", "msg6", false, false,
+                          QOS0) == 0);
+    assert(mqtt_pub_async(broker, "tests/limited/b", "msg7", false, false,
+                          QOS0) == MQTT_WOULDBLOCK);
+    assert(mqtt_pub(broker, "tests/limited/a", "msg8", false, false,
+                    QOS0) == MQTT_WOULDBLOCK);
+    assert(mqtt_pub(broker, "tests/other", "msg9", false, false, QOS0) >= 0);
+    assert(mqtt_set_rate_limit(broker, "tests/limited/#", 0, 0) >= 0);
+    assert(mqtt_pub(broker, "tests/limited/a", "msg8", false, false,
+                    QOS0) >= 0);
+
+    // the queue fills while the peer isn't reading, crossing the high mark,
+    // and drains below the low mark once it reads again
+    loop = loop_connect("this_is_a_loop", &peer);
+    memset(big_msg, 'x', sizeof(big_msg) - 1);
+    big_msg[sizeof(big_msg) - 1] = '\0';
+    assert(mqtt_set_backpressure(loop, 32768, 16384, 4096,
+                                 on_water, NULL) >= 0);
+    while ((ret = mqtt_pub_async(loop, "tests/water", big_msg, false, false,
+                                 QOS0)) == 0)
+        ;
+    assert(ret == MQTT_WOULDBLOCK);
+    assert(mqtt_queued(loop) <= 32768 && mqtt_queued(loop) > 32768 - 1100);
+    assert(water_calls == 1 && water_above && water_queued >= 16384);
+    while (mqtt_queued(loop) > 0) {
+        drain_peer(peer, NULL, 0);
+        assert(mqtt_poll(loop, 10) >= 0);
+    }
+    assert(water_calls == 2 && !water_above && water_queued <= 4096);
+    while (drain_peer(peer, NULL, 0) > 0) // socket buffers, for DISCONNECT
+        usleep(10000);
+    assert(mqtt_disconnect(loop) >= 0);
+    assert(free_broker(loop) >= 0);
+    close(peer);
+
+    // queued behind a full socket, the high priority publish overtakes the
+    // normal ones and the bulk one goes last
+    loop = loop_connect("this_is_a_prio", &peer);
+    assert(mqtt_set_topic_priority(loop, "tests/prio/high",
+                                   MQTT_PRIO_HIGH) >= 0);
+    assert(mqtt_set_topic_priority(loop, "tests/prio/bulk",
+                                   MQTT_PRIO_BULK) >= 0);
+    while (mqtt_queued(loop) < 4096)
+        assert(mqtt_pub_async(loop, "tests/prio/fill", big_msg, false, false,
+                              QOS0) == 0);
+    assert(mqtt_pub_async(loop, "tests/prio/bulk", "msg12", false, false,
+                          QOS0) == 0);
+    assert(mqtt_pub_async(loop, "tests/prio/normal", "msg13", false, false,
+                          QOS0) == 0);
+    assert(mqtt_pub_async(loop, "tests/prio/high", "msg14", false, false,
+                          QOS0) == 0);
+    sent_len = 0;
+    while (mqtt_queued(loop) > 0) {
+        sent_len += drain_peer(peer, &sent[sent_len],
+                               sizeof(sent) - sent_len);
+        assert(mqtt_poll(loop, 10) >= 0);
+    }
+    while ((got = drain_peer(peer, &sent[sent_len],
+                             sizeof(sent) - sent_len)) > 0) {
+        sent_len += got;
+        usleep(10000);
+    }
+    assert(sent_len <= sizeof(sent));
+    assert(find_publish(sent, sent_len, "tests/prio/high") >= 0);
+    assert(find_publish(sent, sent_len, "tests/prio/high") <
+           find_publish(sent, sent_len, "tests/prio/normal"));
+    assert(find_publish(sent, sent_len, "tests/prio/normal") <
+           find_publish(sent, sent_len, "tests/prio/bulk"));
+    assert(mqtt_disconnect(loop) >= 0);
+    assert(free_broker(loop) >= 0);
+    close(peer);
+
+    // buffers are only held while a connection has traffic
+    blocks = live_blocks;
+    loop = loop_connect("this_is_lazy", &peer);
+    assert(live_blocks == blocks + 3); // broker, endpoint, async state
+    while (mqtt_queued(loop) == 0)
+        assert(mqtt_pub_async(loop, "tests/lazy", big_msg, false, false,
+                              QOS0) == 0);
+    pkt_len = build_publish(pkt, "tests/lazy", "msg15");
+    assert(write(peer, pkt, pkt_len) == (ssize_t)pkt_len);
+    assert(mqtt_poll(loop, 1000) >= 0);
+    assert(live_blocks >= blocks + 5); // a lane and the input buffer
+    for (int i = 0; i < 30 && live_blocks > blocks + 3; i++) {
+        drain_peer(peer, NULL, 0);
+        assert(mqtt_poll(loop, 100) >= 0);
+    }
+    assert(live_blocks == blocks + 3 && mqtt_queued(loop) == 0);
+
+    // a packet mqtt_poll started reading is left to it
+    pkt_len = build_publish(pkt, "tests/lazy", "msg16");
+    assert(write(peer, pkt, 3) == 3);
+    assert(mqtt_poll(loop, 1000) == 0);
+    assert(mqtt_get_data(loop, &mqtt_data) < 0);
+    assert(write(peer, &pkt[3], pkt_len - 3) == (ssize_t)pkt_len - 3);
+    assert(mqtt_poll(loop, 1000) == 1);
+
+    // a callback disconnecting in the middle of a read stops the dispatch,
+    // then the buffers are released
+    assert(mqtt_set_callbacks(loop, on_disc_msg, NULL, NULL) >= 0);
+    pkt_len = build_publish(pkt, "tests/lazy", "msg17");
+    pkt_len += build_publish(&pkt[pkt_len], "tests/lazy", "msg18");
+    assert(write(peer, pkt, pkt_len) == (ssize_t)pkt_len);
+    while (disc_msgs == 0)
+        assert(mqtt_poll(loop, 1000) >= 0);
+    assert(disc_msgs == 1 && !loop->connected);
+    assert(live_blocks == blocks + 3);
+    assert(mqtt_poll(loop, 0) < 0);
+    assert(mqtt_disconnect(loop) >= 0);
+    assert(free_broker(loop) >= 0);
+    assert(live_blocks == blocks);
+    close(peer);
+
+    // bulk publishes queue behind everything else
+    assert(mqtt_set_topic_priority(broker, "tests/bulk/#",
+                                   MQTT_PRIO_BULK) >= 0);
+    assert(mqtt_set_topic_priority(broker, "tests/bulk/#", 7) < 0);
+    assert(mqtt_pub(broker, "tests/bulk/a", "msg10", false, false,
+                    QOS1) >= 0);
+    assert(mqtt_ping(broker) >= 0);
+    assert(mqtt_capture_stop(broker) >= 0);
+
+    // capture starts with the CONNECT and its CONNACK
+    cap = mqtt_capture_map("mqtt_test.cap");
+    assert(cap != NULL);
+    assert((rec = mqtt_capture_next(cap, &cap_off)) != NULL);
+    assert(rec->dir == CAPTURE_OUT && (*(char *)(rec + 1) >> 4) == CONNECT);
+    assert((rec = mqtt_capture_next(cap, &cap_off)) != NULL);
+    assert(rec->dir == CAPTURE_IN && (*(char *)(rec + 1) >> 4) == CONNACK);
+    mqtt_capture_close(cap);
+
+    // payload streamed from a file, starting at an offset
+    file = tmpfile();
+    assert(file != NULL && fputs("..msg11", file) >= 0 && fflush(file) == 0);
+    assert(mqtt_sub(broker, "tests/file", QOS0) >= 0);
+    assert(mqtt_pub_fd(broker, "tests/file", fileno(file), 2, 5, QOS0) >= 0);
+    assert(mqtt_get_data(broker, &mqtt_data) >= 0);
+    assert(strcmp(mqtt_data.topic, "tests/file") == 0);
+    assert(mqtt_data.payload_len == strlen("msg11"));
+    assert(strncmp(mqtt_data.payload, "msg11", strlen("msg11")) == 0);
+    assert(mqtt_unsub(broker, "tests/file") >= 0);
+    assert(mqtt_pub_fd(broker, "tests/other", fileno(file), 0, 7, QOS2) >= 0);
+    tv_len = sizeof(tv);
+    assert(getsockopt(broker->socket_fd, SOL_SOCKET, SO_SNDTIMEO, &tv,
+                      &tv_len) >= 0);
+    assert(tv.tv_sec == 0 && tv.tv_usec == 0); // send timeout restored
+    assert(mqtt_pub_fd(broker, "tests/other", fileno(file), 4, 7, QOS0) < 0);
+    fclose(file);
+
+    // pooled connections share the endpoint of the broker
+    pool = mqtt_pool_create(8);
+    assert(pool != NULL);
+    pooled = mqtt_pool_init(pool, "test.mosquitto.org", "this_is_a_pool",
+                            1883);
+    assert(pooled != NULL && pooled->endpoint == broker->endpoint);
+    assert(mqtt_connect(pooled, CLEAN_SESSION, 60) >= 0);
+    assert(mqtt_ping(pooled) >= 0);
+    assert(mqtt_set_allocator(malloc, realloc, free) < 0);
+    assert(mqtt_pool_destroy(pool) < 0);
+    assert(mqtt_disconnect(pooled) >= 0);
+    assert(free_broker(pooled) >= 0);
+    assert(mqtt_pool_destroy(pool) >= 0);
+
+    // nothing listens on port 1, the cluster connects to the broker and
+    // subscribes again when the connection is reported broken
+    cluster = mqtt_cluster_create("this_is_a_cluster", CLEAN_SESSION, 60, 100);
+    assert(cluster != NULL);
+    assert(mqtt_cluster_add(cluster, "127.0.0.1", 1) >= 0);
+    assert(mqtt_cluster_add(cluster, "test.mosquitto.org", 1883) >= 0);
+    memset(long_host, 'a', HOSTNAME_LEN);
+    long_host[HOSTNAME_LEN] = '\0';
+    assert(mqtt_cluster_add(cluster, long_host, 1883) < 0);
+    assert(mqtt_cluster_connect(cluster) >= 0);
+    assert(mqtt_cluster_add(cluster, "127.0.0.1", 2) < 0);
+    assert(cluster->active == 1 && mqtt_cluster_broker(cluster) != NULL);
+    assert(mqtt_cluster_sub(cluster, "tests/test1", QOS0) >= 0);
+    assert(mqtt_get_data(mqtt_cluster_broker(cluster), &mqtt_data) >= 0);
+    assert(mqtt_cluster_check(cluster, true) == 1);
+    assert(mqtt_get_data(mqtt_cluster_broker(cluster), &mqtt_data) >= 0);
+    assert(strncmp(mqtt_data.payload, "msg1", strlen("msg1")) == 0);
+    assert(mqtt_cluster_destroy(cluster) >= 0);
+
     assert(mqtt_disconnect(broker) >= 0);
     assert(free_broker(broker) >= 0);
 
@@ -3,19 +3,49 @@
  * Written by Edward Lu
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE         // CPU affinity
+#endif
+
 #include "mqtt.h"
+#include "mqtt_cache.h"
+#include "mqtt_capture.h"
+#include "mqtt_pool.h"
+#include "mqtt_trace.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include <string.h>
 
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/sendfile.h>
+
+// older libc headers miss the busy poll socket options
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL        46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#endif
 
 /*
  * Based on MQTT Version 3.1.1
@@ -30,9 +60,148 @@
 #define MQTT_V311   0x4     // The value of the protocol level field for
                             // version 3.1.1 is 4 (0x04)
 
+#define IO_BUF_LEN  4096    // initial size of the async API buffers
+#define IO_IDLE_NS  1000000000ULL   // buffers are released after 1 sec idle
+#define MAX_REMAINING_LEN   268435455   // 256 MB, 4 length bytes
+#define SEND_TIMEOUT_MS     30000       // same as the recv timeout (30 sec)
+#define FILE_CHUNK_LEN      65536       // mqtt_pub_fd buffer without sendfile
+
 /* Typedef for convenience */
 typedef struct sockaddr SA;
 
+/* Token bucket, rate in messages per second */
+typedef struct {
+    double rate;            // 0 if unlimited
+    double burst;
+    double tokens;
+    struct timespec last;
+} token_bucket;
+
+/* Rate limit of the topics matching a filter */
+typedef struct {
+    char filter[MAXPACKET_LEN];
+    token_bucket bucket;
+} topic_limit;
+
+/* Priority class of the topics matching a filter */
+typedef struct {
+    char filter[MAXPACKET_LEN];
+    mqtt_prio_t prio;
+} topic_prio;
+
+/*
+ * Outbound lanes, control packets (acks, PINGREQ, SUBSCRIBE, ...) always go
+ * before PUBLISH packets, which are queued by priority class
+ */
+#define LANE_CONTROL    0
+#define NUM_LANES       (1 + MQTT_PRIO_BULK + 1)
+#define LANE_LAST       (NUM_LANES - 1)
+#define LANE_NONE       -1
+
+/* Packets of one lane the socket didn't take yet */
+typedef struct {
+    char *buf;
+    size_t off;             // bytes already sent
+    size_t len;
+    size_t cap;
+    size_t pkt_start;       // bounds of the packet being sent
+    size_t pkt_end;
+} out_lane;
+
+/* Buffers and callbacks of the async API */
+struct mqtt_io {
+    char *in_buf;           // received bytes not yet dispatched
+    size_t in_len;
+    size_t in_cap;
+    out_lane lanes[NUM_LANES];
+    int cur_lane;           // lane of a partly sent packet, or LANE_NONE
+    mqtt_msg_cb on_msg;
+    mqtt_ack_cb on_ack;
+    void *cb_arg;
+
+    // backpressure, a max_queued of 0 leaves the queue unbounded
+    size_t max_queued;
+    size_t high_water;
+    size_t low_water;
+    bool above_high;
+    mqtt_water_cb on_water;
+    void *water_arg;
+    token_bucket conn_limit;
+    topic_limit *topic_limits;
+    int num_topic_limits;
+    topic_prio *topic_prios;
+    int num_topic_prios;
+
+    // low latency mode, receives spin this long before blocking
+    uint64_t spin_ns;
+
+    uint64_t active_ns;         // last poll that had traffic
+    bool dispatching;           // in_buf is in use by io_dispatch
+};
+
+/* Resolved broker address, shared by the connections to the same broker */
+struct mqtt_endpoint {
+    struct mqtt_endpoint *next;
+    int refs;
+    uint16_t port;
+    struct sockaddr_in addr;
+    char hostname[];
+};
+
+#ifdef MQTT_USDT
+/* Raised by tracers attached to the probes, see mqtt_trace.h */
+MQTT_TRACE_SEMAPHORE(encode);
+MQTT_TRACE_SEMAPHORE(send);
+MQTT_TRACE_SEMAPHORE(recv);
+MQTT_TRACE_SEMAPHORE(decode);
+MQTT_TRACE_SEMAPHORE(ack);
+MQTT_TRACE_SEMAPHORE(callback);
+#endif
+
+/* Allocator hooks, see mqtt_set_allocator */
+static void *(*alloc_hook)(size_t) = malloc;
+static void *(*realloc_hook)(void *, size_t) = realloc;
+static void (*free_hook)(void *) = free;
+static atomic_long live_allocs = 0;     // blocks the hooks still have to free
+
+/* Endpoints in use */
+static struct mqtt_endpoint *endpoints = NULL;
+static pthread_mutex_t endpoints_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Allocations of the client, through the allocator hooks
+ */
+void *mqtt_malloc(size_t size) {
+    void *new_ptr = alloc_hook(size);
+
+    if (new_ptr != NULL)
+        atomic_fetch_add(&live_allocs, 1);
+    return new_ptr;
+}
+
+void *mqtt_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return mqtt_malloc(size);
+    }
+
+    return realloc_hook(ptr, size);
+}
+
+void mqtt_free(void *ptr) {
+    if (ptr != NULL) {
+        free_hook(ptr);
+        atomic_fetch_sub(&live_allocs, 1);
+    }
+}
+
+static void *mqtt_zalloc(size_t size) {
+    void *ptr = mqtt_malloc(size);
+
+    if (ptr != NULL)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
 /* Small helper functions */
 static char get_msb(int byte) {
     return (byte >> 8) & 0xff;
@@ -42,6 +211,10 @@ static char get_lsb(int byte) {
     return byte & 0xff;
 }
 
+static uint16_t get_u16(const char *buf) {
+    return ((uint8_t)buf[0] << 8) | (uint8_t)buf[1];
+}
+
 /*
  * The Server MUST allow ClientIds which are between 1 and 23 UTF-8 encoded
  * bytes in length, and that contain only the characters
@@ -52,329 +225,488 @@ static int client_id_valid(const char *client_id) {
 }
 
 /*
- * Initializes mqtt broker with specified hostname and port
+ * Packet identifiers are non-zero
  */
-mqtt_broker *mqtt_init(const char *hostname, const char *client_id,
-                        uint16_t port) {
-    struct hostent *server;
+static uint16_t next_packet_id(uint16_t *id) {
+    if (++(*id) == 0)
+        *id = 1;
+    return *id;
+}
 
-    mqtt_broker *broker = (mqtt_broker *)malloc(sizeof(mqtt_broker));
+/*
+ * Remaining length is encoded 7 bits per byte, the MSB of a byte tells if
+ * another byte follows. Returns number of bytes written.
+ */
+static int encode_remaining_len(char *buf, uint32_t len) {
+    int n = 0;
+
+    do {
+        char byte = len % 128;
+        len /= 128;
+        if (len > 0)
+            byte |= 0x80;
+        buf[n++] = byte;
+    } while (len > 0);
+
+    return n;
+}
 
-    if (broker == NULL) {
-        return NULL;
-    }
-    else if (!client_id_valid(client_id)) {
-        if (VERBOSE)
-            fprintf(stderr, "Invalid client_id\n");
-        free(broker);
-        return NULL;
+/*
+ * Returns number of length bytes read, 0 if more bytes are needed and
+ * -1 if the length is malformed
+ */
+static int decode_remaining_len(const char *buf, size_t avail,
+                                uint32_t *len) {
+    uint32_t mult = 1;
+
+    *len = 0;
+    for (size_t i = 0; i < 4; i++) {
+        if (i >= avail)
+            return 0;
+        *len += (buf[i] & 0x7f) * mult;
+        if ((buf[i] & 0x80) == 0)
+            return i + 1;
+        mult *= 128;
     }
 
-    /*
-     * Save broker information
-     */
-    broker->connected = false;
-    broker->port = port;
-    broker->pub_id = 0;
-    broker->sub_id = 0;
-    strcpy(broker->hostname, hostname);
-    strcpy(broker->client_id, client_id);
-    if ((broker->socket_fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-        if (VERBOSE)
-            fprintf(stderr, "Unable to create socket\n");
-        free(broker);
-        return NULL;
-    }
+    return -1;
+}
 
-    /*
-     * Get server by DNS
-     */
-    if ((server = gethostbyname(broker->hostname)) == NULL) {
-        if (VERBOSE)
-            fprintf(stderr, "Unable to connect to MQTT server\n");
-        free(broker);
-        return NULL;
+/*
+ * Grows buf to hold at least need bytes
+ */
+static int buf_reserve(char **buf, size_t *cap, size_t need) {
+    size_t new_cap = (*cap > 0) ? *cap : IO_BUF_LEN;
+    char *new_buf;
+
+    if (need <= *cap) {
+        return 0;
     }
 
-    /*
-     * Setup and connect to socket
-     */
-    memset((char *) &broker->addr, '\0', sizeof(broker->addr));
-    broker->addr.sin_family = AF_INET;
-    broker->addr.sin_addr.s_addr = *(uint32_t *)(server->h_addr);
-    broker->addr.sin_port = htons(broker->port);
-    broker->addrlen = sizeof(broker->addr);
+    while (new_cap < need)
+        new_cap *= 2;
 
-    if ((connect(broker->socket_fd, (SA *)&broker->addr,
-        broker->addrlen)) < 0) {
+    if ((new_buf = (char *)mqtt_realloc(*buf, new_cap)) == NULL) {
         if (VERBOSE)
-            fprintf(stderr, "Unable to connect to broker\n");
-        free(broker);
-        return NULL;
+            fprintf(stderr, "Unable to grow buffer\n");
+        return -1;
     }
+    *buf = new_buf;
+    *cap = new_cap;
 
-    /*
-     * Set socket recv timeout
-     */
-    struct timeval tv;
-    tv.tv_sec = 30; // 30 sec timeout
-    tv.tv_usec = 0;
-    setsockopt(broker->socket_fd, SOL_SOCKET, SO_RCVTIMEO,
-            (char *)&tv, sizeof(struct timeval));
-
-    return broker;
+    return 0;
 }
 
 /*
- * Connects to mqtt broker with specified params
+ * Shrinks an empty buffer that grew for a large packet back to IO_BUF_LEN,
+ * active connections keep it for the next packet
  */
-int mqtt_connect(mqtt_broker *broker, uint8_t connect_flags,
-                    uint8_t keep_alive) {
-    uint16_t client_id_len, remaining_len, var_header_len,
-             payload_len, connect_msg_len, recv_len;
+static void buf_shrink(char **buf, size_t *cap) {
+    char *new_buf;
 
-    if (broker->connected) {
-        return 0;
+    if (*cap <= IO_BUF_LEN) {
+        return;
     }
 
-    client_id_len = strlen(broker->client_id);
-
-    /*
-     * Setup variable header
-     */
-    char var_header[] =
-    {
-        get_msb(MQTT_LEN),      // protocol length msb
-        get_lsb(MQTT_LEN),      // protocol length lsb
-        'M', 'Q', 'T', 'T',     // protocol name
-        MQTT_V311,              // protocol level
-        connect_flags,          // connect flags
-        get_msb(keep_alive),    // time to keep alive MSB
-        get_lsb(keep_alive)     // time to keep alive LSB
-    };
-    var_header_len = sizeof(var_header);
-    remaining_len = var_header_len;
-
-    /*
-     * Setup payload
-     */
-    char payload[2 + client_id_len];
-    payload[0] = 0;                                         // data length MSB
-    payload[1] = client_id_len;                             // data length LSB
-    memcpy(&payload[2], broker->client_id, client_id_len);  // data
+    if ((new_buf = (char *)mqtt_realloc(*buf, IO_BUF_LEN)) != NULL) {
+        *buf = new_buf;
+        *cap = IO_BUF_LEN;
+    }
+}
 
-    payload_len = sizeof(payload);
-    remaining_len += payload_len;
+/*
+ * Frees an empty buffer, idle connections don't hold any
+ */
+static void buf_release(char **buf, size_t *cap) {
+    mqtt_free(*buf);
+    *buf = NULL;
+    *cap = 0;
+}
 
-    /*
-     * Send MQTT connect message
-     */
+/*
+ * Frees the buffers of a connection with nothing queued or partially read
+ */
+static void io_release(struct mqtt_io *io) {
+    int i;
 
-    // add fixed header
-    connect_msg_len = 2 + remaining_len;
-    char mqtt_connect_msg[connect_msg_len];
-    // send CONNECT since we are connecting
-    mqtt_connect_msg[0] = (uint8_t)(CONNECT << 4);  // MQTT control packet type
-    mqtt_connect_msg[1] = remaining_len;            // Remaining length of data
+    for (i = 0; i < NUM_LANES; i++) {
+        if (io->lanes[i].len == 0)
+            buf_release(&io->lanes[i].buf, &io->lanes[i].cap);
+    }
 
-    // add variable header
-    memcpy(&mqtt_connect_msg[2], var_header, var_header_len);
+    if (io->in_len == 0)
+        buf_release(&io->in_buf, &io->in_cap);
+}
 
-    // add payload
-    memcpy(&mqtt_connect_msg[2] + var_header_len, payload, payload_len);
+/*
+ * Gets the endpoint of hostname and port, resolving it if no other
+ * connection uses it
+ */
+static struct mqtt_endpoint *endpoint_get(const char *hostname,
+                                          uint16_t port) {
+    struct mqtt_endpoint *endpoint;
+    struct hostent *server;
+    size_t len = strlen(hostname);
 
-    /*
-     * Send to broker
-     */
-    if (send(broker->socket_fd, mqtt_connect_msg, connect_msg_len, 0) < 0) {
+    if (len >= HOSTNAME_LEN) {
         if (VERBOSE)
-            fprintf(stderr, "Unable to send CONNECT message to broker\n");
-        free(broker);
-        return -1;
+            fprintf(stderr, "Invalid hostname\n");
+        return NULL;
     }
 
-    /*
-     * Check for correct CONNACK (connection acknowledge) packet
-     */
-    char recv_buf[4], recv_ctrl_packet, recv_remaining_len;
-    if ((recv_len = recv(broker->socket_fd, recv_buf,
-        sizeof(recv_buf), 0)) < 0) {
-        if (VERBOSE)
-            fprintf(stderr, "Unable to receive from mqtt broker\n");
-        free(broker);
-        return -1;
+    pthread_mutex_lock(&endpoints_lock);
+    for (endpoint = endpoints; endpoint != NULL; endpoint = endpoint->next) {
+        if (endpoint->port == port && strcmp(endpoint->hostname, hostname) == 0)
+            break;
     }
 
-    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
-    recv_remaining_len = recv_buf[1];
-    if (recv_ctrl_packet != CONNACK || recv_remaining_len != 2) {
-        if (VERBOSE)
-            fprintf(stderr, "Received packet is invalid CONNACK\n");
-        free(broker);
-        return -1;
+    if (endpoint != NULL) {
+        endpoint->refs++;
     }
-    // check CONNACK flags
-    else if ((recv_buf[2] & 1) != 0) { // Bit 0 session present flag
+    // gethostbyname isn't thread safe, resolve under the lock
+    else if ((server = gethostbyname(hostname)) == NULL) {
         if (VERBOSE)
-            fprintf(stderr, "Acknowledge flag is invalid CONNACK\n");
-        free(broker);
-        return -1;
+            fprintf(stderr, "Unable to connect to MQTT server\n");
     }
-    // check CONNACK return codes
-    // 0x00 is connection accepted
-    else if (recv_buf[3] != 0) {
-        if (VERBOSE)
-            fprintf(stderr, "Return code is invalid CONNACK\n");
-        free(broker);
-        return -1;
+    else if ((endpoint = (struct mqtt_endpoint *)mqtt_zalloc(
+                  sizeof(struct mqtt_endpoint) + len + 1)) != NULL) {
+        endpoint->refs = 1;
+        endpoint->port = port;
+        endpoint->addr.sin_family = AF_INET;
+        endpoint->addr.sin_addr.s_addr = *(uint32_t *)(server->h_addr);
+        endpoint->addr.sin_port = htons(port);
+        memcpy(endpoint->hostname, hostname, len + 1);
+        endpoint->next = endpoints;
+        endpoints = endpoint;
     }
+    pthread_mutex_unlock(&endpoints_lock);
 
-    broker->connected = true;
+    return endpoint;
+}
 
-    return 0;
+static void endpoint_put(struct mqtt_endpoint *endpoint) {
+    struct mqtt_endpoint **prev;
+
+    if (endpoint == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&endpoints_lock);
+    if (--endpoint->refs == 0) {
+        for (prev = &endpoints; *prev != endpoint; prev = &(*prev)->next)
+            ;
+        *prev = endpoint->next;
+        mqtt_free(endpoint);
+    }
+    pthread_mutex_unlock(&endpoints_lock);
 }
 
 /*
- * Publishes a message to broker
+ * Allocates the async API state on first use
  */
-int mqtt_pub(mqtt_broker *broker,
-             const char *topic, const char *msg,
-             bool retain, bool dup, mqtt_qos_t qos) {
-    uint16_t topic_len, msg_len, var_header_len, remaining_len,
-             pub_msg_len, recv_len;
+static struct mqtt_io *io_get(mqtt_broker *broker) {
+    if (broker->io == NULL) {
+        if (broker->pool != NULL)
+            broker->io = (struct mqtt_io *)mqtt_slab_alloc(&broker->pool->ios);
+        else
+            broker->io = (struct mqtt_io *)mqtt_zalloc(sizeof(struct mqtt_io));
+        if (broker->io != NULL)
+            broker->io->cur_lane = LANE_NONE;
+    }
+    return broker->io;
+}
 
-    if (broker == NULL || !broker->connected) {
-        if (VERBOSE)
-            fprintf(stderr, "Broker not set up\n");
-        return -1;
+/*
+ * Bytes waiting in lanes up to and including last_lane
+ */
+static size_t io_queued_upto(struct mqtt_io *io, int last_lane) {
+    size_t queued = 0;
+
+    for (int i = 0; i <= last_lane; i++)
+        queued += io->lanes[i].len - io->lanes[i].off;
+
+    return queued;
+}
+
+/*
+ * Bytes waiting in the outbound queue
+ */
+static size_t io_queued(struct mqtt_io *io) {
+    return io_queued_upto(io, NUM_LANES - 1);
+}
+
+/*
+ * Lane of a PUBLISH, from the priority class of the first matching filter
+ */
+static int io_lane(struct mqtt_io *io, const char *topic) {
+    for (int i = 0; i < io->num_topic_prios; i++) {
+        if (mqtt_topic_matches(io->topic_prios[i].filter, topic))
+            return 1 + io->topic_prios[i].prio;
     }
+    return 1 + MQTT_PRIO_NORMAL;
+}
 
-    topic_len = strlen(topic);
-    msg_len = strlen(msg);
+/*
+ * Calls the water mark callback when the queue crosses a mark
+ */
+static void io_check_water(mqtt_broker *broker) {
+    struct mqtt_io *io = broker->io;
+    size_t queued = io_queued(io);
 
-    /*
-     * Setup variable header
-     */
-    // add 2 bytes for message id if QoS > 0
-    var_header_len = 2 + topic_len + ((qos != QOS0) ? 2 : 0);
-    remaining_len = var_header_len;
+    if (io->on_water == NULL) {
+        return;
+    }
 
-    char var_header[var_header_len];
-    var_header[0] = get_msb(topic_len);
-    var_header[1] = get_lsb(topic_len);
-    memcpy(&var_header[2], topic, topic_len);
+    if (!io->above_high && queued >= io->high_water && io->high_water > 0) {
+        io->above_high = true;
+        io->on_water(broker, true, queued, io->water_arg);
+    }
+    else if (io->above_high && queued <= io->low_water) {
+        io->above_high = false;
+        io->on_water(broker, false, queued, io->water_arg);
+    }
+}
 
-    if (qos != QOS0) {
-        broker->pub_id += 1;
-        var_header[var_header_len - 2] = get_msb(broker->pub_id);
-        var_header[var_header_len - 1] = get_lsb(broker->pub_id);
+/*
+ * Refills a token bucket, returns true if a token is available
+ */
+static bool bucket_ready(token_bucket *bucket, const struct timespec *now) {
+    double elapsed;
+
+    if (bucket->rate <= 0) {
+        return true;
     }
 
-    // add message length
-    remaining_len += msg_len;
+    elapsed = (now->tv_sec - bucket->last.tv_sec) +
+              (now->tv_nsec - bucket->last.tv_nsec) / 1e9;
+    bucket->tokens += elapsed * bucket->rate;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->last = *now;
 
-    /*
-     * Send MQTT publish message
-     */
-    // add fixed header
-    pub_msg_len = 2 + remaining_len;
-    char mqtt_pub_msg[pub_msg_len];
-    // MQTT control packet type | DUP | QoS | RETAIN
-    mqtt_pub_msg[0] = (uint8_t)(PUBLISH << 4) | (dup << 3) |
-                      (qos << 1) | (retain);
-    mqtt_pub_msg[1] = remaining_len;
-    // add variable header
-    memcpy(&mqtt_pub_msg[2], var_header, var_header_len);
-    // add payload (which is just the message to be sent)
-    memcpy(&mqtt_pub_msg[2] + var_header_len, msg, msg_len);
+    return bucket->tokens >= 1;
+}
 
-    /*
-     * Send to broker
-     */
-    if (send(broker->socket_fd, mqtt_pub_msg, pub_msg_len, 0) < 0) {
-        if (VERBOSE)
-            fprintf(stderr, "Unable to send PUBLISH message to broker\n");
-        return -1;
+static void bucket_take(token_bucket *bucket) {
+    if (bucket->rate > 0)
+        bucket->tokens -= 1;
+}
+
+/*
+ * Checks if a PUBLISH of len bytes may be queued, returns MQTT_WOULDBLOCK
+ * if the queue is full or the connection or topic is rate limited
+ */
+static int io_admit(mqtt_broker *broker, const char *topic, size_t len) {
+    struct mqtt_io *io = broker->io;
+    token_bucket *topic_bucket = NULL;
+    struct timespec now;
+
+    // a packet larger than the queue still goes out once the queue is empty
+    if (io->max_queued > 0 && io_queued(io) > 0 &&
+        io_queued(io) + len > io->max_queued) {
+        return MQTT_WOULDBLOCK;
     }
 
-    /*
-     * Check for correct recved packet
-     */
-    char buf[4], recv_ctrl_packet, recv_remaining_len;
+    if (io->conn_limit.rate <= 0 && io->num_topic_limits == 0) {
+        return 0;
+    }
 
-    // For QoS level 1, must receive a PUBACK (publish acknowledge)
-    if (qos == QOS1) {
-        if ((recv_len = recv(broker->socket_fd, buf, sizeof(buf), 0)) < 0) {
-            if (VERBOSE)
-                fprintf(stderr, "Unable to receive from mqtt broker\n");
-            return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < io->num_topic_limits; i++) {
+        if (mqtt_topic_matches(io->topic_limits[i].filter, topic)) {
+            topic_bucket = &io->topic_limits[i].bucket;
+            break;
         }
+    }
 
-        recv_ctrl_packet = (uint8_t)(buf[0] >> 4) & 0xf;
-        recv_remaining_len = buf[1];
-        if (recv_ctrl_packet != PUBACK || recv_remaining_len != 2) {
-            if (VERBOSE)
-                fprintf(stderr, "Received packet is invalid PUBACK\n");
-            return -1;
+    if (!bucket_ready(&io->conn_limit, &now) ||
+        (topic_bucket != NULL && !bucket_ready(topic_bucket, &now))) {
+        return MQTT_WOULDBLOCK;
+    }
+
+    bucket_take(&io->conn_limit);
+    if (topic_bucket != NULL)
+        bucket_take(topic_bucket);
+
+    return 0;
+}
+
+/*
+ * Total length of the queued packet starting at off
+ */
+static size_t lane_pkt_len(out_lane *lane, size_t off) {
+    uint32_t remaining_len;
+    int len_bytes = decode_remaining_len(&lane->buf[off + 1],
+                                         lane->len - off - 1,
+                                         &remaining_len);
+
+    return 1 + len_bytes + remaining_len;
+}
+
+/*
+ * Sends as much of the buffered output as the socket takes. Lanes are only
+ * switched between packets, the highest priority lane with data goes next.
+ */
+static int io_flush(mqtt_broker *broker) {
+    struct mqtt_io *io = broker->io;
+    out_lane *lane;
+    size_t end;
+    ssize_t sent;
+
+    for (;;) {
+        if (io->cur_lane == LANE_NONE) {
+            for (int i = 0; i < NUM_LANES; i++) {
+                if (io->lanes[i].off < io->lanes[i].len) {
+                    io->cur_lane = i;
+                    break;
+                }
+            }
+            if (io->cur_lane == LANE_NONE)
+                break; // all sent
+
+            lane = &io->lanes[io->cur_lane];
+            lane->pkt_start = lane->off;
+            lane->pkt_end = lane->off + lane_pkt_len(lane, lane->off);
         }
-        else if (((uint8_t)(buf[2] << 4) | buf[3]) != broker->pub_id) {
-            if (VERBOSE)
-                fprintf(stderr, "Packet identifer doesn't match PUBACK\n");
-            return -1;
+        lane = &io->lanes[io->cur_lane];
+
+        // send the whole lane unless higher priority packets are waiting
+        // for the packet in progress to finish
+        end = lane->len;
+        for (int i = 0; i < io->cur_lane; i++) {
+            if (io->lanes[i].off < io->lanes[i].len) {
+                end = lane->pkt_end;
+                break;
+            }
         }
-    }
-    // For QoS level 2, must receive a PUBREC (publish receive),
-    // send a PUBREL (publish release), and receive a PUBCOMP (publish complete)
-    else if (qos == QOS2) {
-        // receive PUBREC
-        if ((recv_len = recv(broker->socket_fd, buf, sizeof(buf), 0)) < 0) {
+
+        sent = send(broker->socket_fd, &lane->buf[lane->off],
+                    end - lane->off, MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
             if (VERBOSE)
-                fprintf(stderr, "Unable to receive from mqtt broker\n");
+                fprintf(stderr, "Unable to send to broker\n");
             return -1;
         }
+        MQTT_TRACE_PKT(send, &lane->buf[lane->pkt_start],
+                       lane->len - lane->pkt_start, sent);
+        lane->off += sent;
+
+        // find the packet the socket stopped in
+        while (lane->pkt_end < lane->off) {
+            lane->pkt_start = lane->pkt_end;
+            lane->pkt_end += lane_pkt_len(lane, lane->pkt_end);
+        }
 
-        recv_ctrl_packet = (uint8_t)(buf[0] >> 4) & 0xf;
-        recv_remaining_len = buf[1];
-        if (recv_ctrl_packet != PUBREC || recv_remaining_len != 2) {
-            if (VERBOSE)
-                fprintf(stderr, "Received packet is invalid PUBREC\n");
-            return -1;
+        if (lane->off == lane->len) {
+            lane->off = 0;
+            lane->len = 0;
+            lane->pkt_start = 0;
+            lane->pkt_end = 0;
+            buf_shrink(&lane->buf, &lane->cap);
+            io->cur_lane = LANE_NONE;
         }
-        else if (((uint8_t)(buf[2] << 4) | buf[3]) != broker->pub_id) {
-            if (VERBOSE)
-                fprintf(stderr, "Packet identifer doesn't match PUBREC\n");
-            return -1;
+        else if (lane->off == lane->pkt_end) {
+            io->cur_lane = LANE_NONE; // between packets, may switch lanes
+        }
+        else {
+            break; // socket full in the middle of a packet
         }
+    }
 
-        // send PUBREL
-        buf[0] = (uint8_t)(PUBREL << 4) | (2); // PUBREL + reserved
-        buf[1] = 2; // MSB of length + LSB of lengh (length = 2)
-        buf[2] = get_msb(broker->pub_id);
-        buf[3] = get_lsb(broker->pub_id);
+    io_check_water(broker);
 
-        if (send(broker->socket_fd, buf, sizeof(buf), 0) < 0) {
-            if (VERBOSE)
-                fprintf(stderr, "Unable to send PUBREL message to broker\n");
-            return -1;
+    return 0;
+}
+
+/*
+ * Space for a packet of len bytes at the end of a lane, so large packets are
+ * built in the lane buffer and passed to io_write from there
+ */
+static char *io_reserve(struct mqtt_io *io, int lane_idx, size_t len) {
+    out_lane *lane = &io->lanes[lane_idx];
+
+    if (buf_reserve(&lane->buf, &lane->cap, lane->len + len) < 0) {
+        return NULL;
+    }
+    return &lane->buf[lane->len];
+}
+
+/*
+ * Queues a packet on a lane, writing it directly if nothing is queued
+ */
+static int io_write(mqtt_broker *broker, int lane_idx,
+                    const char *pkt, size_t len) {
+    struct mqtt_io *io = broker->io;
+    out_lane *lane = &io->lanes[lane_idx];
+    ssize_t sent = 0;
+
+    MQTT_TRACE_PKT(encode, pkt, len, len);
+    if (broker->capture != NULL)
+        mqtt_capture_write(broker->capture, CAPTURE_OUT, pkt, len);
+
+    if (io_queued(io) == 0) {
+        if ((sent = send(broker->socket_fd, pkt, len, MSG_DONTWAIT)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                if (VERBOSE)
+                    fprintf(stderr, "Unable to send to broker\n");
+                return -1;
+            }
+            sent = 0;
+        }
+        else {
+            MQTT_TRACE_PKT(send, pkt, len, sent);
         }
+        if ((size_t)sent == len) {
+            return 0;
+        }
+    }
 
-        // receive PUBCOMP
-        if ((recv_len = recv(broker->socket_fd, buf, sizeof(buf), 0)) < 0) {
-            if (VERBOSE)
-                fprintf(stderr, "Unable to receive from mqtt broker\n");
+    // packets built in place with io_reserve are already in the lane
+    if (lane->buf == NULL || pkt != &lane->buf[lane->len]) {
+        if (buf_reserve(&lane->buf, &lane->cap, lane->len + len) < 0) {
             return -1;
         }
+        memcpy(&lane->buf[lane->len], pkt, len);
+    }
 
-        recv_ctrl_packet = (uint8_t)(buf[0] >> 4) & 0xf;
-        recv_remaining_len = buf[1];
-        if (recv_ctrl_packet != PUBCOMP || recv_remaining_len != 2) {
+    // the socket took part of the packet, the rest has to go next
+    if (sent > 0) {
+        lane->off = sent;
+        lane->pkt_start = 0;
+        lane->pkt_end = len;
+        io->cur_lane = lane_idx;
+    }
+    lane->len += len;
+    io_check_water(broker);
+
+    return 0;
+}
+
+/*
+ * Writes a packet and waits until the socket took it and everything queued
+ * before it in the same or a higher priority lane, used by the blocking
+ * API. Gives up after SEND_TIMEOUT_MS without progress.
+ */
+static int io_send(mqtt_broker *broker, int lane_idx,
+                   const char *pkt, size_t len) {
+    struct pollfd pfd;
+
+    if (io_get(broker) == NULL || io_write(broker, lane_idx, pkt, len) < 0) {
+        return -1;
+    }
+
+    pfd.fd = broker->socket_fd;
+    pfd.events = POLLOUT;
+    while (io_queued_upto(broker->io, lane_idx) > 0) {
+        int ret = poll(&pfd, 1, SEND_TIMEOUT_MS);
+        if (ret == 0 || (ret < 0 && errno != EINTR)) {
             if (VERBOSE)
-                fprintf(stderr, "Received packet is invalid PUBCOMP\n");
+                fprintf(stderr, "Send to broker timed out\n");
             return -1;
         }
-        else if (((uint8_t)(buf[2] << 4) | buf[3]) != broker->pub_id) {
-            if (VERBOSE)
-                fprintf(stderr, "Packet identifer doesn't match PUBCOMP\n");
+        if (io_flush(broker) < 0) {
             return -1;
         }
     }
@@ -382,186 +714,1792 @@ int mqtt_pub(mqtt_broker *broker,
     return 0;
 }
 
+static uint64_t mono_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 /*
- * Subscribes to a topic on a broker
+ * Spins on non-blocking receives for up to spin_ns before falling back to
+ * a blocking receive
  */
-int mqtt_sub(mqtt_broker *broker, const char *topic, mqtt_qos_t qos) {
-    uint16_t topic_len, var_header_len, payload_len, remaining_len,
-             sub_msg_len, recv_len;
+static ssize_t recv_spin(int fd, char *buf, size_t len, uint64_t spin_ns) {
+    uint64_t deadline = mono_ns() + spin_ns;
+    ssize_t recv_len;
+
+    do {
+        recv_len = recv(fd, buf, len, MSG_DONTWAIT);
+        if (recv_len >= 0 ||
+            (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return recv_len;
+        }
+    } while (mono_ns() < deadline);
 
-    if (broker == NULL || !broker->connected) {
+    return recv(fd, buf, len, 0);
+}
+
+/*
+ * Blocking receive of the sync API
+ */
+static ssize_t recv_packet(mqtt_broker *broker, char *buf, size_t len) {
+    ssize_t recv_len;
+
+    if (broker->io != NULL && broker->io->spin_ns > 0)
+        recv_len = recv_spin(broker->socket_fd, buf, len, broker->io->spin_ns);
+    else
+        recv_len = recv(broker->socket_fd, buf, len, 0);
+
+    if (recv_len > 0) {
+        MQTT_TRACE_PKT(recv, buf, recv_len, recv_len);
+        if (broker->capture != NULL)
+            mqtt_capture_write(broker->capture, CAPTURE_IN, buf, recv_len);
+    }
+
+    return recv_len;
+}
+
+/*
+ * Sends a 4 byte acknowledgement (PUBACK, PUBREC, PUBREL, PUBCOMP)
+ */
+static int io_write_ack(mqtt_broker *broker, control_packet_t type,
+                        uint16_t packet_id) {
+    char buf[4];
+
+    // PUBREL has reserved flags 0b0010
+    buf[0] = (uint8_t)(type << 4) | ((type == PUBREL) ? 2 : 0);
+    buf[1] = 2;
+    buf[2] = get_msb(packet_id);
+    buf[3] = get_lsb(packet_id);
+
+    return io_write(broker, LANE_CONTROL, buf, sizeof(buf));
+}
+
+/*
+ * Connects a blocking socket, giving up after timeout_ms
+ */
+static int connect_timeout(int fd, const struct sockaddr *addr,
+                           socklen_t addr_len, int timeout_ms) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int flags, err = 0;
+    socklen_t err_len = sizeof(err);
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+
+    if (connect(fd, addr, addr_len) < 0 &&
+        (errno != EINPROGRESS || poll(&pfd, 1, timeout_ms) <= 0 ||
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 ||
+         err != 0)) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/*
+ * Sets up the socket of a zeroed broker and connects it to the broker.
+ * timeout_ms bounds the connect and receives, 0 for the defaults.
+ */
+static int broker_setup(mqtt_broker *broker, const char *hostname,
+                        const char *client_id, uint16_t port,
+                        int timeout_ms) {
+    struct mqtt_endpoint *endpoint;
+
+    broker->socket_fd = -1;
+    if (!client_id_valid(client_id)) {
         if (VERBOSE)
-            fprintf(stderr, "Broker not set up\n");
+            fprintf(stderr, "Invalid client_id\n");
+        return -1;
+    }
+
+    /*
+     * Save broker information
+     */
+    broker->port = port;
+    strcpy(broker->client_id, client_id);
+    if ((broker->socket_fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to create socket\n");
         return -1;
     }
 
-    broker->sub_id++;
+    /*
+     * Get server by DNS, unless another connection already did
+     */
+    if ((broker->endpoint = endpoint = endpoint_get(hostname, port)) == NULL) {
+        return -1;
+    }
 
-    topic_len = strlen(topic);
+    /*
+     * Connect to socket
+     */
+    if ((timeout_ms > 0) ?
+        connect_timeout(broker->socket_fd, (SA *)&endpoint->addr,
+                        sizeof(endpoint->addr), timeout_ms) < 0 :
+        connect(broker->socket_fd, (SA *)&endpoint->addr,
+                sizeof(endpoint->addr)) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to connect to broker\n");
+        return -1;
+    }
+
+    /*
+     * Set socket recv timeout
+     */
+    struct timeval tv;
+    tv.tv_sec = 30; // 30 sec timeout
+    tv.tv_usec = 0;
+    if (timeout_ms > 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+    }
+    setsockopt(broker->socket_fd, SOL_SOCKET, SO_RCVTIMEO,
+            (char *)&tv, sizeof(struct timeval));
+
+    return 0;
+}
+
+/*
+ * Initializes mqtt broker with specified hostname and port
+ */
+mqtt_broker *mqtt_init(const char *hostname, const char *client_id,
+                        uint16_t port) {
+    return mqtt_init_timeout(hostname, client_id, port, 0);
+}
+
+/*
+ * Initializes mqtt broker like mqtt_init, giving up on the connect and on
+ * every receive after timeout_ms
+ */
+mqtt_broker *mqtt_init_timeout(const char *hostname, const char *client_id,
+                               uint16_t port, int timeout_ms) {
+    mqtt_broker *broker = (mqtt_broker *)mqtt_zalloc(sizeof(mqtt_broker));
+
+    if (broker == NULL) {
+        return NULL;
+    }
+
+    if (broker_setup(broker, hostname, client_id, port, timeout_ms) < 0) {
+        free_broker(broker);
+        return NULL;
+    }
+
+    return broker;
+}
+
+/*
+ * Initializes mqtt broker like mqtt_init, taking the broker and its async
+ * API state from a pool
+ */
+mqtt_broker *mqtt_pool_init(mqtt_pool *pool, const char *hostname,
+                            const char *client_id, uint16_t port) {
+    mqtt_broker *broker;
+
+    if (pool == NULL ||
+        (broker = (mqtt_broker *)mqtt_slab_alloc(&pool->brokers)) == NULL) {
+        return NULL;
+    }
+    broker->pool = pool;
+
+    if (broker_setup(broker, hostname, client_id, port, 0) < 0) {
+        free_broker(broker);
+        return NULL;
+    }
+
+    return broker;
+}
+
+/*
+ * Connects to mqtt broker with specified params
+ */
+int mqtt_connect(mqtt_broker *broker, uint8_t connect_flags,
+                    uint8_t keep_alive) {
+    uint16_t client_id_len, remaining_len, var_header_len,
+             payload_len, connect_msg_len, recv_len;
+
+    if (broker->connected) {
+        return 0;
+    }
+
+    client_id_len = strlen(broker->client_id);
 
     /*
      * Setup variable header
      */
-    // add 2 bytes for message id if QoS > 0
     char var_header[] =
     {
-        get_msb(broker->sub_id),    // packet identifer MSB
-        get_lsb(broker->sub_id)     // packet identifer LSB
+        get_msb(MQTT_LEN),      // protocol length msb
+        get_lsb(MQTT_LEN),      // protocol length lsb
+        'M', 'Q', 'T', 'T',     // protocol name
+        MQTT_V311,              // protocol level
+        connect_flags,          // connect flags
+        get_msb(keep_alive),    // time to keep alive MSB
+        get_lsb(keep_alive)     // time to keep alive LSB
     };
-    var_header_len = 2;
+    var_header_len = sizeof(var_header);
     remaining_len = var_header_len;
 
     /*
      * Setup payload
      */
-    // length msb + lsb + topic length + QoS
-    payload_len = 2 + strlen(topic) + 1;
-    remaining_len += payload_len;
+    char payload[2 + client_id_len];
+    payload[0] = 0;                                         // data length MSB
+    payload[1] = client_id_len;                             // data length LSB
+    memcpy(&payload[2], broker->client_id, client_id_len);  // data
 
-    char payload[payload_len];
-    payload[0] = get_msb(topic_len);
-    payload[1] = get_lsb(topic_len);
-    memcpy(&payload[2], topic, topic_len);
-    payload[payload_len - 1] = qos;
+    payload_len = sizeof(payload);
+    remaining_len += payload_len;
 
     /*
-     * Send MQTT subcribe message
+     * Send MQTT connect message
      */
+
     // add fixed header
-    sub_msg_len = 2 + remaining_len;
-    char mqtt_sub_msg[sub_msg_len];
-    mqtt_sub_msg[0] = (uint8_t)(SUBSCRIBE << 4 | 2);
-    mqtt_sub_msg[1] = remaining_len;
+    connect_msg_len = 2 + remaining_len;
+    char mqtt_connect_msg[connect_msg_len];
+    // send CONNECT since we are connecting
+    mqtt_connect_msg[0] = (uint8_t)(CONNECT << 4);  // MQTT control packet type
+    mqtt_connect_msg[1] = remaining_len;            // Remaining length of data
+
     // add variable header
-    memcpy(&mqtt_sub_msg[2], var_header, var_header_len);
+    memcpy(&mqtt_connect_msg[2], var_header, var_header_len);
+
     // add payload
-    memcpy(&mqtt_sub_msg[2] + var_header_len, payload, payload_len);
+    memcpy(&mqtt_connect_msg[2] + var_header_len, payload, payload_len);
 
     /*
      * Send to broker
      */
-    if (send(broker->socket_fd, mqtt_sub_msg, sub_msg_len, 0) < 0) {
+    if (io_send(broker, LANE_CONTROL, mqtt_connect_msg, connect_msg_len) < 0) {
         if (VERBOSE)
-            fprintf(stderr, "Unable to send SUBSCRIBE message to broker\n");
+            fprintf(stderr, "Unable to send CONNECT message to broker\n");
+        free_broker(broker);
         return -1;
     }
 
     /*
-     * Check for correct SUBACK (subscribe acknowledge) packet
+     * Check for correct CONNACK (connection acknowledge) packet
      */
-    char recv_buf[5], recv_ctrl_packet, recv_remaining_len;
-
-    if ((recv_len = recv(broker->socket_fd, recv_buf,
-        sizeof(recv_buf), 0)) < 0) {
+    char recv_buf[4], recv_ctrl_packet, recv_remaining_len;
+    if ((recv_len = recv_packet(broker, recv_buf,
+        sizeof(recv_buf))) < 0) {
         if (VERBOSE)
             fprintf(stderr, "Unable to receive from mqtt broker\n");
+        free_broker(broker);
         return -1;
     }
 
-    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
-    recv_remaining_len = recv_buf[1]; // should be 3 (recv_len=5 - header=2)
-    if (recv_ctrl_packet != SUBACK || recv_remaining_len != 3) {
-        if (VERBOSE)
-            fprintf(stderr, "Received packet is invalid SUBACK\n");
+    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
+    recv_remaining_len = recv_buf[1];
+    if (recv_ctrl_packet != CONNACK || recv_remaining_len != 2) {
+        if (VERBOSE)
+            fprintf(stderr, "Received packet is invalid CONNACK\n");
+        free_broker(broker);
+        return -1;
+    }
+    // check CONNACK flags
+    else if ((recv_buf[2] & 1) != 0) { // Bit 0 session present flag
+        if (VERBOSE)
+            fprintf(stderr, "Acknowledge flag is invalid CONNACK\n");
+        free_broker(broker);
+        return -1;
+    }
+    // check CONNACK return codes
+    // 0x00 is connection accepted
+    else if (recv_buf[3] != 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Return code is invalid CONNACK\n");
+        free_broker(broker);
+        return -1;
+    }
+    MQTT_TRACE(ack, CONNACK, 0, 0, recv_len);
+
+    broker->connected = true;
+
+    return 0;
+}
+
+/*
+ * Waits for the acknowledgements of the publish just sent, a PUBACK for
+ * QoS 1 and PUBREC/PUBREL/PUBCOMP for QoS 2
+ */
+static int pub_wait_ack(mqtt_broker *broker, mqtt_qos_t qos) {
+    char buf[4], recv_ctrl_packet, recv_remaining_len;
+    ssize_t recv_len;
+
+    // For QoS level 1, must receive a PUBACK (publish acknowledge)
+    if (qos == QOS1) {
+        if ((recv_len = recv_packet(broker, buf, sizeof(buf))) < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to receive from mqtt broker\n");
+            return -1;
+        }
+
+        recv_ctrl_packet = (uint8_t)(buf[0] >> 4) & 0xf;
+        recv_remaining_len = buf[1];
+        if (recv_ctrl_packet != PUBACK || recv_remaining_len != 2) {
+            if (VERBOSE)
+                fprintf(stderr, "Received packet is invalid PUBACK\n");
+            return -1;
+        }
+        else if (get_u16(&buf[2]) != broker->pub_id) {
+            if (VERBOSE)
+                fprintf(stderr, "Packet identifer doesn't match PUBACK\n");
+            return -1;
+        }
+        MQTT_TRACE(ack, PUBACK, broker->pub_id, 0, recv_len);
+    }
+    // For QoS level 2, must receive a PUBREC (publish receive),
+    // send a PUBREL (publish release), and receive a PUBCOMP (publish complete)
+    else if (qos == QOS2) {
+        // receive PUBREC
+        if ((recv_len = recv_packet(broker, buf, sizeof(buf))) < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to receive from mqtt broker\n");
+            return -1;
+        }
+
+        recv_ctrl_packet = (uint8_t)(buf[0] >> 4) & 0xf;
+        recv_remaining_len = buf[1];
+        if (recv_ctrl_packet != PUBREC || recv_remaining_len != 2) {
+            if (VERBOSE)
+                fprintf(stderr, "Received packet is invalid PUBREC\n");
+            return -1;
+        }
+        else if (get_u16(&buf[2]) != broker->pub_id) {
+            if (VERBOSE)
+                fprintf(stderr, "Packet identifer doesn't match PUBREC\n");
+            return -1;
+        }
+        MQTT_TRACE(ack, PUBREC, broker->pub_id, 0, recv_len);
+
+        // send PUBREL
+        buf[0] = (uint8_t)(PUBREL << 4) | (2); // PUBREL + reserved
+        buf[1] = 2; // MSB of length + LSB of lengh (length = 2)
+        buf[2] = get_msb(broker->pub_id);
+        buf[3] = get_lsb(broker->pub_id);
+
+        if (io_send(broker, LANE_CONTROL, buf, sizeof(buf)) < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to send PUBREL message to broker\n");
+            return -1;
+        }
+
+        // receive PUBCOMP
+        if ((recv_len = recv_packet(broker, buf, sizeof(buf))) < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to receive from mqtt broker\n");
+            return -1;
+        }
+
+        recv_ctrl_packet = (uint8_t)(buf[0] >> 4) & 0xf;
+        recv_remaining_len = buf[1];
+        if (recv_ctrl_packet != PUBCOMP || recv_remaining_len != 2) {
+            if (VERBOSE)
+                fprintf(stderr, "Received packet is invalid PUBCOMP\n");
+            return -1;
+        }
+        else if (get_u16(&buf[2]) != broker->pub_id) {
+            if (VERBOSE)
+                fprintf(stderr, "Packet identifer doesn't match PUBCOMP\n");
+            return -1;
+        }
+        MQTT_TRACE(ack, PUBCOMP, broker->pub_id, 0, recv_len);
+    }
+
+    return 0;
+}
+
+/*
+ * Publishes a message to broker
+ */
+int mqtt_pub(mqtt_broker *broker,
+             const char *topic, const char *msg,
+             bool retain, bool dup, mqtt_qos_t qos) {
+    uint16_t topic_len, msg_len, var_header_len, remaining_len,
+             pub_msg_len;
+    int ret, len_bytes;
+
+    if (broker == NULL || !broker->connected) {
+        if (VERBOSE)
+            fprintf(stderr, "Broker not set up\n");
+        return -1;
+    }
+
+    topic_len = strlen(topic);
+    msg_len = strlen(msg);
+
+    if (io_get(broker) == NULL) {
+        return -1;
+    }
+
+    /*
+     * Setup variable header
+     */
+    // add 2 bytes for message id if QoS > 0
+    var_header_len = 2 + topic_len + ((qos != QOS0) ? 2 : 0);
+
+    // queue full or rate limited
+    if ((ret = io_admit(broker, topic, 2 + var_header_len + msg_len)) < 0) {
+        return ret;
+    }
+    remaining_len = var_header_len;
+
+    char var_header[var_header_len];
+    var_header[0] = get_msb(topic_len);
+    var_header[1] = get_lsb(topic_len);
+    memcpy(&var_header[2], topic, topic_len);
+
+    if (qos != QOS0) {
+        next_packet_id(&broker->pub_id);
+        var_header[var_header_len - 2] = get_msb(broker->pub_id);
+        var_header[var_header_len - 1] = get_lsb(broker->pub_id);
+    }
+
+    // add message length
+    remaining_len += msg_len;
+
+    /*
+     * Send MQTT publish message
+     */
+    // add fixed header
+    char mqtt_pub_msg[5 + remaining_len];
+    // MQTT control packet type | DUP | QoS | RETAIN
+    mqtt_pub_msg[0] = (uint8_t)(PUBLISH << 4) | (dup << 3) |
+                      (qos << 1) | (retain);
+    len_bytes = encode_remaining_len(&mqtt_pub_msg[1], remaining_len);
+    pub_msg_len = 1 + len_bytes + remaining_len;
+    // add variable header
+    memcpy(&mqtt_pub_msg[1 + len_bytes], var_header, var_header_len);
+    // add payload (which is just the message to be sent)
+    memcpy(&mqtt_pub_msg[1 + len_bytes] + var_header_len, msg, msg_len);
+
+    /*
+     * Send to broker
+     */
+    if (io_send(broker, io_lane(broker->io, topic),
+                mqtt_pub_msg, pub_msg_len) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to send PUBLISH message to broker\n");
+        return -1;
+    }
+
+    return pub_wait_ack(broker, qos);
+}
+
+/*
+ * Sends len bytes of fd from offset, the socket blocks up to the send
+ * timeout
+ */
+static int send_file(int sock, int fd, off_t offset, size_t len) {
+#ifdef __linux__
+    while (len > 0) {
+        ssize_t sent = sendfile(sock, fd, &offset, len);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (sent <= 0) { // 0 if the file shrank
+            return -1;
+        }
+        len -= sent;
+    }
+#else
+    char buf[FILE_CHUNK_LEN];
+
+    while (len > 0) {
+        ssize_t read_len = pread(fd, buf, (len < sizeof(buf)) ? len
+                                                              : sizeof(buf),
+                                 offset);
+
+        if (read_len < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (read_len <= 0) {
+            return -1;
+        }
+
+        for (ssize_t off = 0; off < read_len; ) {
+            ssize_t sent = send(sock, buf + off, read_len - off, 0);
+
+            if (sent < 0 && errno != EINTR) {
+                return -1;
+            }
+            off += (sent > 0) ? sent : 0;
+        }
+        offset += read_len;
+        len -= read_len;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Publishes len bytes of the regular file fd from offset without copying
+ * them through user space. Queued packets are flushed first, then the
+ * PUBLISH header is sent and the kernel streams the payload from the file
+ * (sendfile on Linux, a bounded pread/send loop elsewhere). The file offset
+ * isn't changed. If sending fails halfway the connection has to be dropped.
+ */
+int mqtt_pub_fd(mqtt_broker *broker, const char *topic, int fd,
+                off_t offset, size_t len, mqtt_qos_t qos) {
+    size_t topic_len, var_header_len;
+    struct timeval tv, old_tv;
+    socklen_t old_tv_len;
+    mqtt_capture *capture;
+    struct stat st;
+    int ret, len_bytes;
+
+    if (broker == NULL || !broker->connected) {
+        if (VERBOSE)
+            fprintf(stderr, "Broker not set up\n");
+        return -1;
+    }
+
+    topic_len = strlen(topic);
+    var_header_len = 2 + topic_len + ((qos != QOS0) ? 2 : 0);
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || offset < 0 ||
+        (uint64_t)offset + len > (uint64_t)st.st_size) {
+        if (VERBOSE)
+            fprintf(stderr, "Invalid file range\n");
+        return -1;
+    }
+    else if (topic_len > UINT16_MAX ||
+             len > MAX_REMAINING_LEN - var_header_len) {
+        if (VERBOSE)
+            fprintf(stderr, "Publish too large\n");
+        return -1;
+    }
+
+    if (io_get(broker) == NULL) {
+        return -1;
+    }
+
+    // rate limited, the payload itself never enters the queue
+    if ((ret = io_admit(broker, topic, 5 + var_header_len)) < 0) {
+        return ret;
+    }
+
+    /*
+     * Fixed and variable header, the payload follows from the file
+     */
+    char mqtt_pub_msg[5 + var_header_len], *var_header;
+
+    mqtt_pub_msg[0] = (uint8_t)(PUBLISH << 4) | (qos << 1);
+    len_bytes = encode_remaining_len(&mqtt_pub_msg[1], var_header_len + len);
+    var_header = &mqtt_pub_msg[1 + len_bytes];
+    var_header[0] = get_msb(topic_len);
+    var_header[1] = get_lsb(topic_len);
+    memcpy(&var_header[2], topic, topic_len);
+
+    if (qos != QOS0) {
+        next_packet_id(&broker->pub_id);
+        var_header[var_header_len - 2] = get_msb(broker->pub_id);
+        var_header[var_header_len - 1] = get_lsb(broker->pub_id);
+    }
+
+    // the capture gets the whole packet, payload read from the file
+    if ((capture = broker->capture) != NULL) {
+        mqtt_capture_write_fd(capture, CAPTURE_OUT, mqtt_pub_msg,
+                              1 + len_bytes + var_header_len, fd, offset, len);
+        broker->capture = NULL;
+    }
+
+    // nothing may go between header and payload, so the queue goes first
+    ret = io_send(broker, LANE_LAST, mqtt_pub_msg,
+                  1 + len_bytes + var_header_len);
+    broker->capture = capture;
+    if (ret < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to send PUBLISH message to broker\n");
+        return -1;
+    }
+
+    // bound the blocking sends of the payload, then put back the timeout
+    // the socket had
+    old_tv_len = sizeof(old_tv);
+    if (getsockopt(broker->socket_fd, SOL_SOCKET, SO_SNDTIMEO,
+                   (char *)&old_tv, &old_tv_len) < 0) {
+        old_tv.tv_sec = 0;
+        old_tv.tv_usec = 0;
+    }
+    tv.tv_sec = SEND_TIMEOUT_MS / 1000;
+    tv.tv_usec = 0;
+    setsockopt(broker->socket_fd, SOL_SOCKET, SO_SNDTIMEO,
+               (char *)&tv, sizeof(struct timeval));
+
+    ret = send_file(broker->socket_fd, fd, offset, len);
+    setsockopt(broker->socket_fd, SOL_SOCKET, SO_SNDTIMEO,
+               (char *)&old_tv, sizeof(struct timeval));
+    if (ret < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to send payload to broker\n");
+        return -1;
+    }
+    MQTT_TRACE(send, PUBLISH, (qos != QOS0) ? broker->pub_id : 0,
+               topic_len, len);
+
+    return pub_wait_ack(broker, qos);
+}
+
+/*
+ * Subscribes to a topic on a broker
+ */
+int mqtt_sub(mqtt_broker *broker, const char *topic, mqtt_qos_t qos) {
+    uint16_t topic_len, var_header_len, payload_len, remaining_len,
+             sub_msg_len, recv_len;
+    int len_bytes;
+
+    if (broker == NULL || !broker->connected) {
+        if (VERBOSE)
+            fprintf(stderr, "Broker not set up\n");
+        return -1;
+    }
+
+    /*
+     * Already subscribed to a topic whose retained value is cached, serve it
+     * from the cache instead of a broker round trip
+     */
+    if (broker->cache != NULL &&
+        mqtt_cache_subscribed(broker->cache, topic, qos) &&
+        mqtt_cache_complete(broker->cache, topic)) {
+        mqtt_cache_queue_retained(broker->cache, topic);
+        return 0;
+    }
+
+    next_packet_id(&broker->sub_id);
+
+    topic_len = strlen(topic);
+
+    /*
+     * Setup variable header
+     */
+    // add 2 bytes for message id if QoS > 0
+    char var_header[] =
+    {
+        get_msb(broker->sub_id),    // packet identifer MSB
+        get_lsb(broker->sub_id)     // packet identifer LSB
+    };
+    var_header_len = 2;
+    remaining_len = var_header_len;
+
+    /*
+     * Setup payload
+     */
+    // length msb + lsb + topic length + QoS
+    payload_len = 2 + strlen(topic) + 1;
+    remaining_len += payload_len;
+
+    char payload[payload_len];
+    payload[0] = get_msb(topic_len);
+    payload[1] = get_lsb(topic_len);
+    memcpy(&payload[2], topic, topic_len);
+    payload[payload_len - 1] = qos;
+
+    /*
+     * Send MQTT subcribe message
+     */
+    // add fixed header
+    char mqtt_sub_msg[5 + remaining_len];
+    mqtt_sub_msg[0] = (uint8_t)(SUBSCRIBE << 4 | 2);
+    len_bytes = encode_remaining_len(&mqtt_sub_msg[1], remaining_len);
+    sub_msg_len = 1 + len_bytes + remaining_len;
+    // add variable header
+    memcpy(&mqtt_sub_msg[1 + len_bytes], var_header, var_header_len);
+    // add payload
+    memcpy(&mqtt_sub_msg[1 + len_bytes] + var_header_len, payload,
+           payload_len);
+
+    /*
+     * Send to broker
+     */
+    if (io_send(broker, LANE_CONTROL, mqtt_sub_msg, sub_msg_len) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to send SUBSCRIBE message to broker\n");
+        return -1;
+    }
+
+    /*
+     * Check for correct SUBACK (subscribe acknowledge) packet
+     */
+    char recv_buf[5], recv_ctrl_packet, recv_remaining_len;
+
+    if ((recv_len = recv_packet(broker, recv_buf,
+        sizeof(recv_buf))) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to receive from mqtt broker\n");
+        return -1;
+    }
+
+    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
+    recv_remaining_len = recv_buf[1]; // should be 3 (recv_len=5 - header=2)
+    if (recv_ctrl_packet != SUBACK || recv_remaining_len != 3) {
+        if (VERBOSE)
+            fprintf(stderr, "Received packet is invalid SUBACK\n");
+        return -1;
+    }
+    else if (get_u16(&recv_buf[2]) != broker->sub_id) {
+        if (VERBOSE)
+            fprintf(stderr, "Packet identifer doesn't match SUBACK\n");
+        return -1;
+    }
+    else if (qos != recv_buf[4]) {
+        if (VERBOSE)
+            fprintf(stderr, "Return code is invalid SUBACK\n");
+        return -1;
+    }
+    MQTT_TRACE(ack, SUBACK, broker->sub_id, 0, recv_len);
+
+    if (broker->cache != NULL) {
+        mqtt_cache_sub(broker->cache, topic, qos);
+    }
+
+    return 0;
+}
+
+/*
+ * Unsubscribes to a topic on a broker
+ */
+int mqtt_unsub(mqtt_broker *broker, const char *topic) {
+    uint16_t topic_len, var_header_len, payload_len, remaining_len,
+             sub_msg_len, recv_len;
+    int len_bytes;
+
+    if (broker == NULL || !broker->connected) {
+        if (VERBOSE)
+            fprintf(stderr, "Broker not set up\n");
+        return -1;
+    }
+
+    next_packet_id(&broker->sub_id);
+    topic_len = strlen(topic);
+
+    /*
+     * Setup variable header
+     */
+    // add 2 bytes for message id if QoS > 0
+    char var_header[] =
+    {
+        get_msb(broker->sub_id),    // packet identifer MSB
+        get_lsb(broker->sub_id)     // packet identifer LSB
+    };
+    var_header_len = 2;
+    remaining_len = var_header_len;
+
+    /*
+     * Setup payload
+     */
+    // length msb + lsb + topic length + QoS
+    payload_len = 2 + strlen(topic);
+    remaining_len += payload_len;
+
+    char payload[payload_len];
+    payload[0] = get_msb(topic_len);
+    payload[1] = get_lsb(topic_len);
+    memcpy(&payload[2], topic, topic_len);
+
+    /*
+     * Send MQTT subcribe message
+     */
+    // add fixed header
+    char mqtt_sub_msg[5 + remaining_len];
+    mqtt_sub_msg[0] = (uint8_t)(UNSUBSCRIBE << 4 | 2);
+    len_bytes = encode_remaining_len(&mqtt_sub_msg[1], remaining_len);
+    sub_msg_len = 1 + len_bytes + remaining_len;
+    // add variable header
+    memcpy(&mqtt_sub_msg[1 + len_bytes], var_header, var_header_len);
+    // add payload
+    memcpy(&mqtt_sub_msg[1 + len_bytes] + var_header_len, payload,
+           payload_len);
+
+    /*
+     * Send to broker
+     */
+    if (io_send(broker, LANE_CONTROL, mqtt_sub_msg, sub_msg_len) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to send UNSUBSCRIBE message to broker\n");
+        return -1;
+    }
+
+    /*
+     * Check for correct UNSUBACK (unsubscribe acknowledge) packet
+     */
+    char recv_buf[4], recv_ctrl_packet, recv_remaining_len;
+
+    if ((recv_len = recv_packet(broker, recv_buf,
+        sizeof(recv_buf))) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to receive from mqtt broker\n");
+        return -1;
+    }
+
+    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
+    recv_remaining_len = recv_buf[1];
+    if (recv_ctrl_packet != UNSUBACK || recv_remaining_len != 2) {
+        if (VERBOSE)
+            fprintf(stderr, "Received packet is invalid UNSUBACK\n");
+        return -1;
+    }
+    else if (get_u16(&recv_buf[2]) != broker->sub_id) {
+        if (VERBOSE)
+            fprintf(stderr, "Packet identifer doesn't match UNSUBACK\n");
+        return -1;
+    }
+    MQTT_TRACE(ack, UNSUBACK, broker->sub_id, 0, recv_len);
+
+    if (broker->cache != NULL) {
+        mqtt_cache_unsub(broker->cache, topic);
+    }
+
+    return 0;
+}
+
+/*
+ * Ping the server, used in Keep Alive processing
+ */
+int mqtt_ping(mqtt_broker *broker) {
+    if (broker == NULL || !broker->connected) {
+        if (VERBOSE)
+            fprintf(stderr, "Broker not set up\n");
+        return -1;
+    }
+
+    /*
+     * Setup packet, which is just the fixed header
+     */
+    char mqtt_ping_msg[] =
+    {
+        (uint8_t)(PINGREQ << 4),
+        0
+    };
+
+    /*
+     * Send to broker
+     */
+    if (io_send(broker, LANE_CONTROL, mqtt_ping_msg, 2) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to send PINGREQ message to broker\n");
+        free_broker(broker);
+        return -1;
+    }
+
+    /*
+     * Check for correct PINGRESP (ping response) packet
+     */
+    char recv_buf[2], recv_len, recv_ctrl_packet, recv_remaining_len;
+
+    if ((recv_len = recv_packet(broker, recv_buf, 2)) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to receive from mqtt broker\n");
+        return -1;
+    }
+
+    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
+    recv_remaining_len = recv_buf[1];
+    if (recv_ctrl_packet != PINGRESP || recv_remaining_len != 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Received packet is invalid PINGRESP\n");
+        return -1;
+    }
+    MQTT_TRACE(ack, PINGRESP, 0, 0, recv_len);
+
+    return 0;
+}
+
+/*
+ * Length of the PUBLISH packet carrying data
+ */
+static int publish_len(const mqtt_data_t *data) {
+    char len_buf[4];
+    uint32_t remaining_len = 2 + data->topic_len +
+                             ((data->qos != QOS0) ? 2 : 0) + data->payload_len;
+
+    return 1 + encode_remaining_len(len_buf, remaining_len) + remaining_len;
+}
+
+/*
+ * Get data of last subscribed topic, returns length of the PUBLISH packet
+ * the data came in, or would have come in when served from the cache
+ */
+int mqtt_get_data(mqtt_broker *broker, mqtt_data_t *data) {
+    uint16_t remaining_len, recv_remaining_len, var_header_len;
+    char recv_buf[MAXPACKET_LEN], recv_ctrl_packet;
+    ssize_t recv_len;
+
+    // values served from the cache don't touch the socket
+    if (broker->cache != NULL &&
+        mqtt_cache_pop_pending(broker->cache, data) == 0) {
+        return publish_len(data);
+    }
+
+    // packets already read by mqtt_poll have to be dispatched by it
+    if (broker->io != NULL && broker->io->in_len > 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Data waiting for mqtt_poll\n");
+        return -1;
+    }
+
+    if ((recv_len = recv_packet(broker, recv_buf, MAXPACKET_LEN)) <= 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Receive data failure\n");
+        return -1;
+    }
+
+    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
+    remaining_len = recv_buf[1];
+    if (recv_ctrl_packet != PUBLISH) {
+        if (VERBOSE)
+            fprintf(stderr, "Received packet is invalid\n");
+        return -1;
+    }
+
+    /*
+     * Parse buffer
+     */
+    // fixed header = Control packet|dup|Qos|retain + remaining length
+    data->qos = (recv_buf[0] >> 1) & 0b11;
+    data->retain = recv_buf[0] & 1;
+
+    // variable header = topic length msb + lsb + topic + packet id msb + lsb
+    data->topic_len = get_u16(&recv_buf[2]);
+    memcpy(data->topic, &recv_buf[4], data->topic_len);
+    data->topic[data->topic_len] = '\0';
+    var_header_len = 2 + data->topic_len;
+
+    if (data->qos != QOS0) { // QoS1 and Q0S2 have message id
+        data->msg_id = get_u16(&recv_buf[data->topic_len + 4]);
+        var_header_len += 2;
+    }
+    else {
+        data->msg_id = -1;
+    }
+
+    // payload is the rest
+    // - length can be calculated by subtracting the length of the variable
+    // header from the remaining length field that is in the fixed header
+    data->payload_len = remaining_len - var_header_len;
+    memcpy(data->payload, &recv_buf[var_header_len + 2], data->payload_len);
+    MQTT_TRACE(decode, PUBLISH, (data->msg_id < 0) ? 0 : data->msg_id,
+               data->topic_len, recv_len);
+
+    if (broker->cache != NULL) {
+        mqtt_cache_put(broker->cache, data);
+    }
+
+    char buf[4];
+
+    // For QoS level 1, must send a PUBACK (publish acknowledge)
+    if (data->qos == QOS1) {
+        buf[0] = (uint8_t)(PUBACK << 4);
+        buf[1] = 2;
+        buf[2] = get_msb(data->msg_id);
+        buf[3] = get_lsb(data->msg_id);
+
+        if (io_send(broker, LANE_CONTROL, buf, sizeof(buf)) < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to send PUBACK message to broker\n");
+            return -1;
+        }
+    }
+    // For QoS level 2, must send a PUBREC (publish receive),
+    // receive a PUBREL (publish release), and send a PUBCOMP (publish complete)
+    else if (data->qos == QOS2) {
+        // send PUBREC
+        buf[0] = (uint8_t)(PUBREC << 4);
+        buf[1] = 2;
+        buf[2] = get_msb(data->msg_id);
+        buf[3] = get_lsb(data->msg_id);
+
+        if (io_send(broker, LANE_CONTROL, buf, sizeof(buf)) < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to send PUBREC message to broker\n");
+            return -1;
+        }
+
+        // receive PUBREL
+        if ((recv_len = recv_packet(broker, buf, sizeof(buf))) < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to receive from mqtt broker\n");
+            return -1;
+        }
+
+        recv_ctrl_packet = (uint8_t)(buf[0] >> 4) & 0xf;
+        recv_remaining_len = buf[1];
+        if (recv_ctrl_packet != PUBREL || recv_remaining_len != 2) {
+            if (VERBOSE)
+                fprintf(stderr, "Received packet is invalid PUBREL\n");
+            return -1;
+        }
+
+        // send PUBCOMP
+        buf[0] = (uint8_t)(PUBCOMP << 4);
+        buf[1] = 2;
+        buf[2] = get_msb(data->msg_id);
+        buf[3] = get_lsb(data->msg_id);
+
+        if (io_send(broker, LANE_CONTROL, buf, sizeof(buf)) < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to send PUBCOMP message to broker\n");
+            return -1;
+        }
+
+    }
+
+    return publish_len(data);
+}
+
+/*
+ * Disconnects broker
+ */
+int mqtt_disconnect(mqtt_broker *broker) {
+    if (broker == NULL || !broker->connected) {
+        return 0;
+    }
+
+    /*
+     * DISCONNECT + no payload
+     */
+    char mqtt_disconnect_msg[2] =
+    {
+        (uint8_t)(DISCONNECT << 4), // MQTT control packet type << 4
+        0                           // no remaining length
+    };
+
+    /*
+     * Send to broker
+     */
+    // goes after everything queued, which the broker would drop otherwise
+    if (io_send(broker, LANE_LAST, mqtt_disconnect_msg, 2) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to send DISCONNECT message to broker\n");
+        free_broker(broker);
+        return -1;
+    }
+
+    broker->connected = false;
+
+    // only active connections hold buffers, a callback disconnecting leaves
+    // them to io_dispatch, which is still reading in_buf
+    if (!broker->io->dispatching) {
+        broker->io->in_len = 0;
+        io_release(broker->io);
+    }
+
+    return 0;
+}
+
+/*
+ * Frees memory taken by broker structure
+ */
+int free_broker(mqtt_broker *broker) {
+    if (broker != NULL) {
+        if (broker->socket_fd >= 0)
+            close(broker->socket_fd);
+        mqtt_cache_free(broker->cache);
+        mqtt_capture_close(broker->capture);
+        endpoint_put(broker->endpoint);
+        if (broker->io != NULL) {
+            mqtt_free(broker->io->in_buf);
+            for (int i = 0; i < NUM_LANES; i++)
+                mqtt_free(broker->io->lanes[i].buf);
+            mqtt_free(broker->io->topic_limits);
+            mqtt_free(broker->io->topic_prios);
+            if (broker->pool != NULL)
+                mqtt_slab_free(&broker->pool->ios, broker->io);
+            else
+                mqtt_free(broker->io);
+        }
+        if (broker->pool != NULL)
+            mqtt_slab_free(&broker->pool->brokers, broker);
+        else
+            mqtt_free(broker);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Async API
+ *
+ * Packets are written without blocking, whatever the socket doesn't take is
+ * buffered and flushed by mqtt_poll. mqtt_poll also reads and dispatches
+ * incoming packets, acknowledgements are reported through the ack callback
+ * and messages through the message callback.
+ */
+
+/*
+ * Reads whatever the socket has without blocking
+ */
+static int io_read(mqtt_broker *broker) {
+    struct mqtt_io *io = broker->io;
+    ssize_t recv_len;
+
+    for (;;) {
+        if (buf_reserve(&io->in_buf, &io->in_cap,
+                        io->in_len + IO_BUF_LEN) < 0) {
+            return -1;
+        }
+
+        recv_len = recv(broker->socket_fd, &io->in_buf[io->in_len],
+                        io->in_cap - io->in_len, MSG_DONTWAIT);
+        if (recv_len == 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Broker closed the connection\n");
+            broker->connected = false;
+            return -1;
+        }
+        else if (recv_len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            if (VERBOSE)
+                fprintf(stderr, "Receive data failure\n");
+            return -1;
+        }
+
+        io->in_len += recv_len;
+        MQTT_TRACE_PKT(recv, io->in_buf, io->in_len, recv_len);
+        if (io->in_len < io->in_cap)
+            return 0; // drained the socket
+    }
+}
+
+/*
+ * Parses an incoming PUBLISH, acknowledges it and calls the message callback
+ */
+static int io_handle_publish(mqtt_broker *broker, uint8_t header,
+                             const char *body, uint32_t len) {
+    struct mqtt_io *io = broker->io;
+    mqtt_data_t data;
+    uint32_t topic_len, var_header_len, payload_len;
+
+    data.qos = (header >> 1) & 0b11;
+    data.retain = header & 1;
+
+    // variable header = topic length msb + lsb + topic + packet id msb + lsb
+    if (len < 2) {
+        return -1;
+    }
+    topic_len = ((uint8_t)body[0] << 8) | (uint8_t)body[1];
+    var_header_len = 2 + topic_len + ((data.qos != QOS0) ? 2 : 0);
+    if (var_header_len > len || topic_len >= MAXPACKET_LEN) {
+        if (VERBOSE)
+            fprintf(stderr, "Received packet is invalid PUBLISH\n");
+        return -1;
+    }
+
+    data.topic_len = topic_len;
+    memcpy(data.topic, &body[2], topic_len);
+    data.topic[topic_len] = '\0';
+
+    if (data.qos != QOS0) {
+        data.msg_id = ((uint8_t)body[2 + topic_len] << 8) |
+                      (uint8_t)body[3 + topic_len];
+    }
+    else {
+        data.msg_id = -1;
+    }
+
+    // payloads that don't fit mqtt_data_t are truncated
+    payload_len = len - var_header_len;
+    data.payload_len = (payload_len < MAXPACKET_LEN) ?
+                       payload_len : MAXPACKET_LEN;
+    memcpy(data.payload, &body[var_header_len], data.payload_len);
+
+    if (data.qos == QOS1) {
+        if (io_write_ack(broker, PUBACK, data.msg_id) < 0)
+            return -1;
+    }
+    else if (data.qos == QOS2) {
+        // PUBCOMP is sent when the PUBREL arrives
+        if (io_write_ack(broker, PUBREC, data.msg_id) < 0)
+            return -1;
+    }
+
+    if (broker->cache != NULL) {
+        mqtt_cache_put(broker->cache, &data);
+    }
+
+    if (io->on_msg != NULL) {
+        MQTT_TRACE(callback, PUBLISH, (data.msg_id < 0) ? 0 : data.msg_id,
+                   topic_len, data.payload_len);
+        io->on_msg(broker, &data, io->cb_arg);
+    }
+
+    return 0;
+}
+
+/*
+ * Handles one complete incoming packet
+ */
+static int io_handle_packet(mqtt_broker *broker, uint8_t header,
+                            const char *body, uint32_t len) {
+    struct mqtt_io *io = broker->io;
+    control_packet_t type = (header >> 4) & 0xf;
+    uint16_t packet_id = 0;
+    int status = 0;
+
+    if (type == PUBLISH) {
+        return io_handle_publish(broker, header, body, len);
+    }
+
+    // everything else but PINGRESP starts with a packet identifier
+    if (type != PINGRESP) {
+        if (len < 2) {
+            if (VERBOSE)
+                fprintf(stderr, "Received packet is invalid\n");
+            return -1;
+        }
+        packet_id = ((uint8_t)body[0] << 8) | (uint8_t)body[1];
+    }
+
+    switch (type) {
+    case PUBREC:
+        MQTT_TRACE(ack, type, packet_id, 0, len);
+        return io_write_ack(broker, PUBREL, packet_id);
+    case PUBREL:
+        return io_write_ack(broker, PUBCOMP, packet_id);
+    case SUBACK:
+        // return code of the single topic filter, or FAILURE
+        status = (len > 2) ? (uint8_t)body[2] : FAILURE;
+        break;
+    case PUBACK:
+    case PUBCOMP:
+    case UNSUBACK:
+    case PINGRESP:
+        break;
+    default:
+        if (VERBOSE)
+            fprintf(stderr, "Received packet is invalid\n");
+        return -1;
+    }
+
+    MQTT_TRACE(ack, type, packet_id, 0, len);
+
+    if (io->on_ack != NULL) {
+        MQTT_TRACE(callback, type, packet_id, 0, len);
+        io->on_ack(broker, type, packet_id, status, io->cb_arg);
+    }
+
+    return 0;
+}
+
+/*
+ * Dispatches all complete packets in the input buffer
+ */
+static int io_dispatch(mqtt_broker *broker) {
+    struct mqtt_io *io = broker->io;
+    size_t off = 0;
+    int handled = 0, ret = 0;
+
+    io->dispatching = true;
+    while (broker->connected && io->in_len - off >= 2) {
+        uint32_t remaining_len;
+        int len_bytes = decode_remaining_len(&io->in_buf[off + 1],
+                                             io->in_len - off - 1,
+                                             &remaining_len);
+        if (len_bytes < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Received packet length is invalid\n");
+            ret = -1;
+            break;
+        }
+        else if (len_bytes == 0 ||
+                 io->in_len - off < 1 + len_bytes + remaining_len) {
+            break; // wait for the rest of the packet
+        }
+        MQTT_TRACE_PKT(decode, &io->in_buf[off], io->in_len - off,
+                       1 + len_bytes + remaining_len);
+        if (broker->capture != NULL)
+            mqtt_capture_write(broker->capture, CAPTURE_IN, &io->in_buf[off],
+                               1 + len_bytes + remaining_len);
+
+        if (io_handle_packet(broker, io->in_buf[off],
+                             &io->in_buf[off + 1 + len_bytes],
+                             remaining_len) < 0) {
+            ret = -1;
+            break;
+        }
+
+        off += 1 + len_bytes + remaining_len;
+        handled++;
+    }
+    io->dispatching = false;
+
+    // a callback disconnected, the rest of the input goes with the buffers
+    if (!broker->connected) {
+        io->in_len = 0;
+        io_release(io);
+        return (ret < 0) ? ret : handled;
+    }
+    else if (ret < 0) {
+        return ret;
+    }
+
+    memmove(io->in_buf, &io->in_buf[off], io->in_len - off);
+    io->in_len -= off;
+    if (io->in_len == 0)
+        buf_shrink(&io->in_buf, &io->in_cap);
+
+    return handled;
+}
+
+/*
+ * Sets the callbacks called from mqtt_poll
+ */
+int mqtt_set_callbacks(mqtt_broker *broker, mqtt_msg_cb on_msg,
+                       mqtt_ack_cb on_ack, void *arg) {
+    struct mqtt_io *io;
+
+    if (broker == NULL || (io = io_get(broker)) == NULL) {
+        return -1;
+    }
+
+    io->on_msg = on_msg;
+    io->on_ack = on_ack;
+    io->cb_arg = arg;
+
+    return 0;
+}
+
+/*
+ * Publishes a message to broker without waiting for the acknowledgement.
+ * Returns the packet identifier (0 for QoS 0), completion of QoS 1 and 2 is
+ * reported as PUBACK and PUBCOMP to the ack callback. Returns
+ * MQTT_WOULDBLOCK if the outbound queue is full or the topic is rate limited.
+ */
+int mqtt_pub_async(mqtt_broker *broker,
+                   const char *topic, const char *msg,
+                   bool retain, bool dup, mqtt_qos_t qos) {
+    uint32_t topic_len, msg_len, remaining_len;
+    uint16_t packet_id = 0;
+    char header[5], *pkt;
+    int pkt_len, lane, ret;
+
+    if (broker == NULL || !broker->connected || io_get(broker) == NULL) {
+        if (VERBOSE)
+            fprintf(stderr, "Broker not set up\n");
+        return -1;
+    }
+
+    topic_len = strlen(topic);
+    msg_len = strlen(msg);
+
+    // topic length + topic + message id if QoS > 0 + message
+    remaining_len = 2 + topic_len + ((qos != QOS0) ? 2 : 0) + msg_len;
+    if (remaining_len > MAX_REMAINING_LEN) {
+        if (VERBOSE)
+            fprintf(stderr, "PUBLISH message too long\n");
+        return -1;
+    }
+
+    // MQTT control packet type | DUP | QoS | RETAIN
+    header[0] = (uint8_t)(PUBLISH << 4) | (dup << 3) | (qos << 1) | (retain);
+    pkt_len = 1 + encode_remaining_len(&header[1], remaining_len);
+
+    // queue full or rate limited
+    if ((ret = io_admit(broker, topic, pkt_len + remaining_len)) < 0) {
+        return ret;
+    }
+
+    // built in the lane buffer, the message can be far larger than the stack
+    lane = io_lane(broker->io, topic);
+    if ((pkt = io_reserve(broker->io, lane, pkt_len + remaining_len)) == NULL) {
+        return -1;
+    }
+    memcpy(pkt, header, pkt_len);
+
+    pkt[pkt_len++] = get_msb(topic_len);
+    pkt[pkt_len++] = get_lsb(topic_len);
+    memcpy(&pkt[pkt_len], topic, topic_len);
+    pkt_len += topic_len;
+
+    if (qos != QOS0) {
+        packet_id = next_packet_id(&broker->pub_id);
+        pkt[pkt_len++] = get_msb(packet_id);
+        pkt[pkt_len++] = get_lsb(packet_id);
+    }
+
+    memcpy(&pkt[pkt_len], msg, msg_len);
+    pkt_len += msg_len;
+
+    if (io_write(broker, lane, pkt, pkt_len) < 0) {
+        return -1;
+    }
+
+    return packet_id;
+}
+
+/*
+ * Builds a SUBSCRIBE or UNSUBSCRIBE packet for a single topic filter
+ */
+static int io_write_sub(mqtt_broker *broker, control_packet_t type,
+                        const char *topic, mqtt_qos_t qos) {
+    uint32_t topic_len, remaining_len;
+    uint16_t packet_id;
+    char header[5], *pkt;
+    int pkt_len;
+
+    if (broker == NULL || !broker->connected || io_get(broker) == NULL) {
+        if (VERBOSE)
+            fprintf(stderr, "Broker not set up\n");
+        return -1;
+    }
+
+    topic_len = strlen(topic);
+
+    // packet id + topic length + topic + QoS (SUBSCRIBE only)
+    remaining_len = 2 + 2 + topic_len + ((type == SUBSCRIBE) ? 1 : 0);
+    if (remaining_len > MAX_REMAINING_LEN) {
+        return -1;
+    }
+
+    header[0] = (uint8_t)(type << 4 | 2);
+    pkt_len = 1 + encode_remaining_len(&header[1], remaining_len);
+    if ((pkt = io_reserve(broker->io, LANE_CONTROL,
+                          pkt_len + remaining_len)) == NULL) {
+        return -1;
+    }
+    memcpy(pkt, header, pkt_len);
+
+    packet_id = next_packet_id(&broker->sub_id);
+    pkt[pkt_len++] = get_msb(packet_id);
+    pkt[pkt_len++] = get_lsb(packet_id);
+
+    pkt[pkt_len++] = get_msb(topic_len);
+    pkt[pkt_len++] = get_lsb(topic_len);
+    memcpy(&pkt[pkt_len], topic, topic_len);
+    pkt_len += topic_len;
+
+    if (type == SUBSCRIBE)
+        pkt[pkt_len++] = qos;
+
+    if (io_write(broker, LANE_CONTROL, pkt, pkt_len) < 0) {
+        return -1;
+    }
+
+    return packet_id;
+}
+
+/*
+ * Subscribes to a topic without waiting for the SUBACK, returns the packet
+ * identifier reported with the SUBACK to the ack callback
+ */
+int mqtt_sub_async(mqtt_broker *broker, const char *topic, mqtt_qos_t qos) {
+    return io_write_sub(broker, SUBSCRIBE, topic, qos);
+}
+
+/*
+ * Unsubscribes to a topic without waiting for the UNSUBACK
+ */
+int mqtt_unsub_async(mqtt_broker *broker, const char *topic) {
+    return io_write_sub(broker, UNSUBSCRIBE, topic, QOS0);
+}
+
+/*
+ * Pings the server without waiting for the PINGRESP
+ */
+int mqtt_ping_async(mqtt_broker *broker) {
+    char mqtt_ping_msg[] =
+    {
+        (uint8_t)(PINGREQ << 4),
+        0
+    };
+
+    if (broker == NULL || !broker->connected || io_get(broker) == NULL) {
+        if (VERBOSE)
+            fprintf(stderr, "Broker not set up\n");
+        return -1;
+    }
+
+    return io_write(broker, LANE_CONTROL, mqtt_ping_msg,
+                    sizeof(mqtt_ping_msg));
+}
+
+/*
+ * Polls the socket, spinning first in low latency mode
+ */
+static int io_wait(struct mqtt_io *io, struct pollfd *pfd, int timeout_ms) {
+    uint64_t start, deadline;
+    int ret;
+
+    if (io->spin_ns == 0 || timeout_ms == 0) {
+        return poll(pfd, 1, timeout_ms);
+    }
+
+    start = mono_ns();
+    deadline = start + io->spin_ns;
+    do {
+        if ((ret = poll(pfd, 1, 0)) != 0) {
+            return ret;
+        }
+    } while (mono_ns() < deadline);
+
+    // what is left of the timeout after spinning
+    if (timeout_ms > 0) {
+        timeout_ms -= (int)((mono_ns() - start) / 1000000);
+        if (timeout_ms <= 0)
+            return 0;
+    }
+    return poll(pfd, 1, timeout_ms);
+}
+
+/*
+ * Flushes buffered output and dispatches incoming packets, waiting at most
+ * timeout_ms for the socket. Returns number of packets handled.
+ */
+int mqtt_poll(mqtt_broker *broker, int timeout_ms) {
+    struct mqtt_io *io;
+    struct pollfd pfd;
+    mqtt_data_t data;
+    int handled = 0, ret;
+
+    if (broker == NULL || !broker->connected || (io = io_get(broker)) == NULL) {
+        return -1;
+    }
+
+    // values served from the cache go first, like mqtt_get_data
+    while (broker->cache != NULL &&
+           mqtt_cache_pop_pending(broker->cache, &data) == 0) {
+        if (io->on_msg != NULL) {
+            MQTT_TRACE(callback, PUBLISH, 0, data.topic_len,
+                       data.payload_len);
+            io->on_msg(broker, &data, io->cb_arg);
+        }
+        handled++;
+    }
+
+    if (io_flush(broker) < 0) {
+        return -1;
+    }
+
+    pfd.fd = broker->socket_fd;
+    pfd.events = POLLIN | (mqtt_want_write(broker) ? POLLOUT : 0);
+    if ((ret = io_wait(io, &pfd, handled > 0 ? 0 : timeout_ms)) < 0) {
+        return (errno == EINTR) ? handled : -1;
+    }
+    else if (ret == 0) {
+        // an idle connection gives its buffers back until traffic resumes
+        if (handled == 0 && mono_ns() - io->active_ns >= IO_IDLE_NS)
+            io_release(io);
+        return handled;
+    }
+    io->active_ns = mono_ns();
+
+    if ((pfd.revents & POLLOUT) && io_flush(broker) < 0) {
+        return -1;
+    }
+
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (io_read(broker) < 0 || (ret = io_dispatch(broker)) < 0) {
+            return -1;
+        }
+        handled += ret;
+
+        // acknowledgements queued while dispatching
+        if (io_flush(broker) < 0) {
+            return -1;
+        }
+    }
+
+    return handled;
+}
+
+/*
+ * Checks if mqtt_poll has buffered output to flush, event loops should then
+ * also wait for the socket to become writable
+ */
+bool mqtt_want_write(mqtt_broker *broker) {
+    return broker != NULL && broker->io != NULL && io_queued(broker->io) > 0;
+}
+
+/*
+ * Bounds the outbound queue to max_queued bytes (0 for unbounded), publishes
+ * that don't fit return MQTT_WOULDBLOCK. on_water is called when the queue
+ * grows to high_water and again when it drains to low_water.
+ */
+int mqtt_set_backpressure(mqtt_broker *broker, size_t max_queued,
+                          size_t high_water, size_t low_water,
+                          mqtt_water_cb on_water, void *arg) {
+    struct mqtt_io *io;
+
+    if (broker == NULL || (io = io_get(broker)) == NULL) {
+        return -1;
+    }
+    else if (low_water > high_water ||
+             (max_queued > 0 && high_water > max_queued)) {
+        if (VERBOSE)
+            fprintf(stderr, "Invalid water marks\n");
+        return -1;
+    }
+
+    io->max_queued = max_queued;
+    io->high_water = high_water;
+    io->low_water = low_water;
+    io->on_water = on_water;
+    io->water_arg = arg;
+    io->above_high = false;
+    io_check_water(broker);
+
+    return 0;
+}
+
+/*
+ * Limits publishes to rate messages per second with bursts of up to burst
+ * messages, for the whole connection if topic is NULL or else for the topics
+ * matching the topic filter. A rate of 0 removes the limit.
+ */
+int mqtt_set_rate_limit(mqtt_broker *broker, const char *topic,
+                        double rate, double burst) {
+    struct mqtt_io *io;
+    token_bucket *bucket = NULL;
+
+    if (broker == NULL || (io = io_get(broker)) == NULL) {
+        return -1;
+    }
+
+    if (topic == NULL) {
+        bucket = &io->conn_limit;
+    }
+    else {
+        for (int i = 0; i < io->num_topic_limits; i++) {
+            if (strcmp(io->topic_limits[i].filter, topic) == 0) {
+                bucket = &io->topic_limits[i].bucket;
+                break;
+            }
+        }
+
+        if (bucket == NULL) {
+            topic_limit *limits;
+
+            if (strlen(topic) >= MAXPACKET_LEN ||
+                (limits = (topic_limit *)mqtt_realloc(io->topic_limits,
+                    (io->num_topic_limits + 1) * sizeof(topic_limit)))
+                    == NULL) {
+                return -1;
+            }
+            io->topic_limits = limits;
+            strcpy(limits[io->num_topic_limits].filter, topic);
+            bucket = &limits[io->num_topic_limits].bucket;
+            io->num_topic_limits++;
+        }
+    }
+
+    bucket->rate = (rate > 0) ? rate : 0;
+    bucket->burst = (burst >= 1) ? burst : 1;
+    bucket->tokens = bucket->burst;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+
+    return 0;
+}
+
+/*
+ * Bytes in the outbound queue waiting for the socket
+ */
+size_t mqtt_queued(mqtt_broker *broker) {
+    if (broker == NULL || broker->io == NULL) {
+        return 0;
+    }
+    return io_queued(broker->io);
+}
+
+/*
+ * Sets the priority class of publishes to the topics matching the topic
+ * filter, the first filter set that matches a topic is used. Publishes to
+ * other topics are MQTT_PRIO_NORMAL. Acknowledgements and other control
+ * packets always go before any publish.
+ */
+int mqtt_set_topic_priority(mqtt_broker *broker, const char *topic,
+                            mqtt_prio_t prio) {
+    struct mqtt_io *io;
+    topic_prio *prios;
+
+    if (broker == NULL || topic == NULL || (io = io_get(broker)) == NULL) {
         return -1;
     }
-    else if (((uint8_t)(recv_buf[2] << 4) | recv_buf[3]) != broker->sub_id) {
+    else if (prio < MQTT_PRIO_HIGH || prio > MQTT_PRIO_BULK) {
         if (VERBOSE)
-            fprintf(stderr, "Packet identifer doesn't match SUBACK\n");
+            fprintf(stderr, "Invalid priority class\n");
         return -1;
     }
-    else if (qos != recv_buf[4]) {
-        if (VERBOSE)
-            fprintf(stderr, "Return code is invalid SUBACK\n");
+
+    for (int i = 0; i < io->num_topic_prios; i++) {
+        if (strcmp(io->topic_prios[i].filter, topic) == 0) {
+            io->topic_prios[i].prio = prio;
+            return 0;
+        }
+    }
+
+    if (strlen(topic) >= MAXPACKET_LEN ||
+        (prios = (topic_prio *)mqtt_realloc(io->topic_prios,
+            (io->num_topic_prios + 1) * sizeof(topic_prio))) == NULL) {
         return -1;
     }
+    io->topic_prios = prios;
+    strcpy(prios[io->num_topic_prios].filter, topic);
+    prios[io->num_topic_prios].prio = prio;
+    io->num_topic_prios++;
 
     return 0;
 }
 
 /*
- * Unsubscribes to a topic on a broker
+ * Enables the last-value cache, holding at most capacity topics
  */
-int mqtt_unsub(mqtt_broker *broker, const char *topic) {
-    uint16_t topic_len, var_header_len, payload_len, remaining_len,
-             sub_msg_len, recv_len;
-
-    if (broker == NULL || !broker->connected) {
-        if (VERBOSE)
-            fprintf(stderr, "Broker not set up\n");
+int mqtt_cache_enable(mqtt_broker *broker, int capacity) {
+    if (broker == NULL) {
         return -1;
     }
+    else if (broker->cache != NULL) {
+        return 0;
+    }
 
-    topic_len = strlen(topic);
-
-    /*
-     * Setup variable header
-     */
-    // add 2 bytes for message id if QoS > 0
-    char var_header[] =
-    {
-        get_msb(broker->sub_id),    // packet identifer MSB
-        get_lsb(broker->sub_id)     // packet identifer LSB
-    };
-    var_header_len = 2;
-    remaining_len = var_header_len;
-
-    /*
-     * Setup payload
-     */
-    // length msb + lsb + topic length + QoS
-    payload_len = 2 + strlen(topic);
-    remaining_len += payload_len;
-
-    char payload[payload_len];
-    payload[0] = get_msb(topic_len);
-    payload[1] = get_lsb(topic_len);
-    memcpy(&payload[2], topic, topic_len);
-
-    /*
-     * Send MQTT subcribe message
-     */
-    // add fixed header
-    sub_msg_len = 2 + remaining_len;
-    char mqtt_sub_msg[sub_msg_len];
-    mqtt_sub_msg[0] = (uint8_t)(UNSUBSCRIBE << 4 | 2);
-    mqtt_sub_msg[1] = remaining_len;
-    // add variable header
-    memcpy(&mqtt_sub_msg[2], var_header, var_header_len);
-    // add payload
-    memcpy(&mqtt_sub_msg[2] + var_header_len, payload, payload_len);
-
-    /*
-     * Send to broker
-     */
-    if (send(broker->socket_fd, mqtt_sub_msg, sub_msg_len, 0) < 0) {
+    if ((broker->cache = mqtt_cache_create(capacity)) == NULL) {
         if (VERBOSE)
-            fprintf(stderr, "Unable to send UNSUBSCRIBE message to broker\n");
+            fprintf(stderr, "Unable to create cache\n");
         return -1;
     }
 
-    /*
-     * Check for correct UNSUBACK (unsubscribe acknowledge) packet
-     */
-    char recv_buf[4], recv_ctrl_packet, recv_remaining_len;
+    return 0;
+}
 
-    if ((recv_len = recv(broker->socket_fd, recv_buf,
-        sizeof(recv_buf), 0)) < 0) {
-        if (VERBOSE)
-            fprintf(stderr, "Unable to receive from mqtt broker\n");
+/*
+ * Gets the latest cached value of a topic without a broker round trip
+ */
+int mqtt_get_last(mqtt_broker *broker, const char *topic, mqtt_data_t *data) {
+    if (broker == NULL || broker->cache == NULL) {
         return -1;
     }
 
-    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
-    recv_remaining_len = recv_buf[1];
-    if (recv_ctrl_packet != UNSUBACK || recv_remaining_len != 2) {
-        if (VERBOSE)
-            fprintf(stderr, "Received packet is invalid UNSUBACK\n");
+    return mqtt_cache_get(broker->cache, topic, data);
+}
+
+/*
+ * Checks if mqtt_get_data can return data without reading the socket
+ */
+bool mqtt_data_pending(mqtt_broker *broker) {
+    return broker != NULL && broker->cache != NULL &&
+           broker->cache->pending_len > 0;
+}
+
+/*
+ * Records every packet sent and received on the connection to a capture
+ * file at path, see mqtt_replay for playing it back
+ */
+int mqtt_capture_start(mqtt_broker *broker, const char *path) {
+    if (broker == NULL || path == NULL) {
         return -1;
     }
-    else if (((uint8_t)(recv_buf[2] << 4) | recv_buf[3]) > broker->sub_id) {
+
+    mqtt_capture_close(broker->capture);
+    if ((broker->capture = mqtt_capture_open(path)) == NULL) {
         if (VERBOSE)
-            fprintf(stderr, "Packet identifer doesn't match UNSUBACK\n");
+            fprintf(stderr, "Unable to start capture\n");
         return -1;
     }
 
@@ -569,206 +2507,185 @@ int mqtt_unsub(mqtt_broker *broker, const char *topic) {
 }
 
 /*
- * Ping the server, used in Keep Alive processing
+ * Stops the capture, the file is complete after this returns
  */
-int mqtt_ping(mqtt_broker *broker) {
-    if (broker == NULL || !broker->connected) {
-        if (VERBOSE)
-            fprintf(stderr, "Broker not set up\n");
+int mqtt_capture_stop(mqtt_broker *broker) {
+    if (broker == NULL) {
         return -1;
     }
 
-    /*
-     * Setup packet, which is just the fixed header
-     */
-    char mqtt_ping_msg[] =
-    {
-        (uint8_t)(PINGREQ << 4),
-        0
-    };
+    mqtt_capture_close(broker->capture);
+    broker->capture = NULL;
 
-    /*
-     * Send to broker
-     */
-    if (send(broker->socket_fd, mqtt_ping_msg, 2, 0) < 0) {
-        if (VERBOSE)
-            fprintf(stderr, "Unable to send PINGREQ message to broker\n");
-        free(broker);
+    return 0;
+}
+
+/*
+ * Opt-in low latency mode, trading CPU for receive latency: disables Nagle,
+ * asks the kernel to busy poll the device queue for spin_us and makes
+ * receives spin on the socket for spin_us before blocking. A spin_us of 0
+ * only disables Nagle.
+ */
+int mqtt_set_low_latency(mqtt_broker *broker, int spin_us) {
+    struct mqtt_io *io;
+    int one = 1;
+
+    if (broker == NULL || spin_us < 0 || (io = io_get(broker)) == NULL) {
         return -1;
     }
 
-    /*
-     * Check for correct PINGRESP (ping response) packet
-     */
-    char recv_buf[2], recv_len, recv_ctrl_packet, recv_remaining_len;
-
-    if ((recv_len = recv(broker->socket_fd, recv_buf, 2, 0)) < 0) {
+    if (setsockopt(broker->socket_fd, IPPROTO_TCP, TCP_NODELAY,
+                   &one, sizeof(one)) < 0) {
         if (VERBOSE)
-            fprintf(stderr, "Unable to receive from mqtt broker\n");
+            perror("setsockopt TCP_NODELAY");
         return -1;
     }
 
-    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
-    recv_remaining_len = recv_buf[1];
-    if (recv_ctrl_packet != PINGRESP || recv_remaining_len != 0) {
+#ifdef __linux__
+    // needs CAP_NET_ADMIN above net.core.busy_poll, spinning works without
+    if (spin_us > 0 &&
+        (setsockopt(broker->socket_fd, SOL_SOCKET, SO_BUSY_POLL,
+                    &spin_us, sizeof(spin_us)) < 0 ||
+         setsockopt(broker->socket_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                    &one, sizeof(one)) < 0)) {
         if (VERBOSE)
-            fprintf(stderr, "Received packet is invalid PINGRESP\n");
-        return -1;
+            fprintf(stderr, "Kernel busy polling not enabled\n");
     }
+#endif
+
+    io->spin_ns = (uint64_t)spin_us * 1000;
 
     return 0;
 }
 
 /*
- * Get data of last subscribed topic
+ * Pins the calling thread, which should be the one receiving, to cpu
  */
-int mqtt_get_data(mqtt_broker *broker, mqtt_data_t *data) {
-    uint16_t recv_len, remaining_len, recv_remaining_len, var_header_len;
-    char recv_buf[MAXPACKET_LEN], recv_ctrl_packet;
+int mqtt_pin_cpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
 
-    if ((recv_len = recv(broker->socket_fd, recv_buf, MAXPACKET_LEN, 0)) < 0) {
-        if (VERBOSE)
-            fprintf(stderr, "Receive data failure\n");
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
         return -1;
     }
 
-    recv_ctrl_packet = (uint8_t)(recv_buf[0] >> 4) & 0xf;
-    remaining_len = recv_buf[1];
-    if (recv_ctrl_packet != PUBLISH) {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set),
+                                        &set)) != 0) {
         if (VERBOSE)
-            fprintf(stderr, "Received packet is invalid\n");
+            perror("pthread_setaffinity_np");
         return -1;
     }
 
-    /*
-     * Parse buffer
-     */
-    // fixed header = Control packet|dup|Qos|retain + remaining length
-    data->qos = (recv_buf[0] >> 1) & 0b11;
+    return 0;
+#else
+    (void)cpu;
+    if (VERBOSE)
+        fprintf(stderr, "CPU pinning not supported\n");
+    return -1;
+#endif
+}
 
-    // variable header = topic length msb + lsb + topic + packet id msb + lsb
-    data->topic_len = (int)(recv_buf[2] << 4) | (recv_buf[3]);
-    memcpy(data->topic, &recv_buf[4], data->topic_len);
-    data->topic[data->topic_len] = '\0';
-    var_header_len = 2 + data->topic_len;
+/*
+ * Creates a pool of connections, allocated conns_per_slab at a time
+ */
+mqtt_pool *mqtt_pool_create(int conns_per_slab) {
+    mqtt_pool *pool = (mqtt_pool *)mqtt_malloc(sizeof(mqtt_pool));
 
-    if (data->qos != QOS0) { // QoS1 and Q0S2 have message id
-        data->msg_id = (int)(recv_buf[data->topic_len + 4] << 4) |
-                             recv_buf[data->topic_len + 5];
-        var_header_len += 2;
-    }
-    else {
-        data->msg_id = -1;
+    if (pool == NULL) {
+        return NULL;
     }
 
-    // payload is the rest
-    // - length can be calculated by subtracting the length of the variable
-    // header from the remaining length field that is in the fixed header
-    data->payload_len = remaining_len - var_header_len;
-    memcpy(data->payload, &recv_buf[var_header_len + 2], data->payload_len);
-
-    char buf[4];
+    mqtt_slab_init(&pool->brokers, sizeof(mqtt_broker), conns_per_slab);
+    mqtt_slab_init(&pool->ios, sizeof(struct mqtt_io), conns_per_slab);
 
-    // For QoS level 1, must send a PUBACK (publish acknowledge)
-    if (data->qos == QOS1) {
-        buf[0] = (uint8_t)(PUBACK << 4);
-        buf[1] = 2;
-        buf[2] = get_msb(data->msg_id);
-        buf[3] = get_lsb(data->msg_id);
+    return pool;
+}
 
-        if (send(broker->socket_fd, buf, sizeof(buf), 0) < 0) {
-            if (VERBOSE)
-                fprintf(stderr, "Unable to send PUBACK message to broker\n");
-            return -1;
-        }
+/*
+ * Frees a pool, all of its brokers have to be freed first
+ */
+int mqtt_pool_destroy(mqtt_pool *pool) {
+    if (pool == NULL) {
+        return -1;
     }
-    // For QoS level 2, must send a PUBREC (publish receive),
-    // receive a PUBREL (publish release), and send a PUBCOMP (publish complete)
-    else if (data->qos == QOS2) {
-        // send PUBREC
-        buf[0] = (uint8_t)(PUBREC << 4);
-        buf[1] = 2;
-        buf[2] = get_msb(data->msg_id);
-        buf[3] = get_lsb(data->msg_id);
-
-        if (send(broker->socket_fd, buf, sizeof(buf), 0) < 0) {
-            if (VERBOSE)
-                fprintf(stderr, "Unable to send PUBREC message to broker\n");
-            return -1;
-        }
-
-        // receive PUBREL
-        if ((recv_len = recv(broker->socket_fd, buf, sizeof(buf), 0)) < 0) {
-            if (VERBOSE)
-                fprintf(stderr, "Unable to receive from mqtt broker\n");
-            return -1;
-        }
-
-        recv_ctrl_packet = (uint8_t)(buf[0] >> 4) & 0xf;
-        recv_remaining_len = buf[1];
-        if (recv_ctrl_packet != PUBREL || recv_remaining_len != 2) {
-            if (VERBOSE)
-                fprintf(stderr, "Received packet is invalid PUBREL\n");
-            return -1;
-        }
-
-        // send PUBCOMP
-        buf[0] = (uint8_t)(PUBCOMP << 4);
-        buf[1] = 2;
-        buf[2] = get_msb(data->msg_id);
-        buf[3] = get_lsb(data->msg_id);
-
-        if (send(broker->socket_fd, buf, sizeof(buf), 0) < 0) {
-            if (VERBOSE)
-                fprintf(stderr, "Unable to send PUBCOMP message to broker\n");
-            return -1;
-        }
-
+    else if (pool->brokers.in_use > 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Pool still has brokers in use\n");
+        return -1;
     }
 
-    return recv_len;
+    mqtt_slab_destroy(&pool->brokers);
+    mqtt_slab_destroy(&pool->ios);
+    mqtt_free(pool);
+
+    return 0;
 }
 
 /*
- * Disconnects broker
+ * Replaces malloc, realloc and free for everything the client allocates.
+ * Has to be called before any broker is initialized.
  */
-int mqtt_disconnect(mqtt_broker *broker) {
-    if (broker == NULL || !broker->connected) {
-        return 0;
-    }
-
-    /*
-     * DISCONNECT + no payload
-     */
-    char mqtt_disconnect_msg[2] =
-    {
-        (uint8_t)(DISCONNECT << 4), // MQTT control packet type << 4
-        0                           // no remaining length
-    };
+int mqtt_set_allocator(void *(*alloc_fn)(size_t),
+                       void *(*realloc_fn)(void *, size_t),
+                       void (*free_fn)(void *)) {
+    int ret = 0;
 
-    /*
-     * Send to broker
-     */
-    if (send(broker->socket_fd, mqtt_disconnect_msg, 2, 0) < 0) {
-        if (VERBOSE)
-            fprintf(stderr, "Unable to send DISCONNECT message to broker\n");
-        free(broker);
+    if ((alloc_fn == NULL) != (realloc_fn == NULL) ||
+        (alloc_fn == NULL) != (free_fn == NULL)) {
         return -1;
     }
 
-    broker->connected = false;
+    // memory from the old hooks would be freed with the new free
+    pthread_mutex_lock(&endpoints_lock);
+    if (endpoints != NULL || atomic_load(&live_allocs) > 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Allocator set while its memory is in use\n");
+        ret = -1;
+    }
+    else {
+        // NULL restores the defaults
+        alloc_hook = (alloc_fn != NULL) ? alloc_fn : malloc;
+        realloc_hook = (realloc_fn != NULL) ? realloc_fn : realloc;
+        free_hook = (free_fn != NULL) ? free_fn : free;
+    }
+    pthread_mutex_unlock(&endpoints_lock);
 
-    return 0;
+    return ret;
 }
 
 /*
- * Frees memory taken by broker structure
+ * Checks if a topic name matches a topic filter, which may contain the
+ * single level (+) and multi level (#) wildcards
  */
-int free_broker(mqtt_broker *broker) {
-    if (broker != NULL) {
-        close(broker->socket_fd);
-        free(broker);
-        return 0;
+bool mqtt_topic_matches(const char *filter, const char *topic) {
+    // wildcards don't match topics beginning with $ (e.g. $SYS)
+    if (topic[0] == '$' && (filter[0] == '+' || filter[0] == '#')) {
+        return false;
     }
-    return -1;
+
+    while (*filter != '\0') {
+        if (*filter == '#') {
+            return true;
+        }
+        else if (*filter == '+') {
+            while (*topic != '\0' && *topic != '/')
+                topic++;
+            filter++;
+        }
+        else if (*filter == *topic) {
+            filter++;
+            topic++;
+        }
+        // "sport/#" also matches the parent level "sport"
+        else if (*topic == '\0' && strcmp(filter, "/#") == 0) {
+            return true;
+        }
+        else {
+            return false;
+        }
+    }
+
+    return *topic == '\0';
 }
@@ -15,6 +15,8 @@
 #define CLIENTID_LEN    24      // between 1 and 23 + null terminator
 #define MAXPACKET_LEN   255
 
+#define MQTT_WOULDBLOCK -2      // outbound queue full or rate limited
+
 /* Connect flags */
 #define CLEAN_SESSION   0b10
 #define WILL_FLAG       0b100
@@ -24,17 +26,22 @@
 
 /* MQTT broker struct */
 typedef struct {
-    bool connected;
     int socket_fd;
     uint16_t port;
     uint16_t pub_id;
     uint16_t sub_id;
-    struct sockaddr_in addr;
-    socklen_t addrlen;
-    char hostname[HOSTNAME_LEN];
+    bool connected;
     char client_id[CLIENTID_LEN];
+    struct mqtt_endpoint *endpoint; // hostname and address, shared by the
+                                    // connections to the same broker
+    struct mqtt_pool *pool;     // pool the broker came from, NULL if none
+    struct mqtt_cache *cache;   // last-value cache, NULL if disabled
+    struct mqtt_io *io;         // buffers and callbacks of the async API
+    struct mqtt_capture *capture;   // packet capture, NULL if disabled
 } mqtt_broker;
 
+typedef struct mqtt_pool mqtt_pool;
+
 /* Control packet */
 typedef enum {
     UNDEF,
@@ -57,6 +64,9 @@ typedef enum {
 /* Quality of service */
 typedef enum { QOS0, QOS1, QOS2, FAILURE=0x80} mqtt_qos_t;
 
+/* Outbound priority class of PUBLISH packets */
+typedef enum { MQTT_PRIO_HIGH, MQTT_PRIO_NORMAL, MQTT_PRIO_BULK } mqtt_prio_t;
+
 /* MQTT data struct */
 typedef struct {
     mqtt_qos_t qos;
@@ -65,15 +75,32 @@ typedef struct {
     int payload_len;
     char topic[MAXPACKET_LEN];
     char payload[MAXPACKET_LEN];
+    bool retain;
 } mqtt_data_t;
 
+/* Async API callbacks, called from mqtt_poll */
+typedef void (*mqtt_msg_cb)(mqtt_broker *broker, const mqtt_data_t *data,
+                            void *arg);
+typedef void (*mqtt_ack_cb)(mqtt_broker *broker, control_packet_t type,
+                            uint16_t packet_id, int status, void *arg);
+
+/* Outbound queue crossed the high (above=true) or low water mark */
+typedef void (*mqtt_water_cb)(mqtt_broker *broker, bool above,
+                              size_t queued, void *arg);
+
 mqtt_broker *mqtt_init(const char *broker_ip, const char *client_id,
                         uint16_t port);
+mqtt_broker *mqtt_init_timeout(const char *broker_ip, const char *client_id,
+                               uint16_t port, int timeout_ms);
+mqtt_broker *mqtt_pool_init(mqtt_pool *pool, const char *broker_ip,
+                            const char *client_id, uint16_t port);
 int mqtt_connect(mqtt_broker *broker, uint8_t connect_flags,
                     uint8_t keep_alive);
 int mqtt_pub(mqtt_broker *broker,
              const char *topic, const char *msg,
              bool retain, bool dup, mqtt_qos_t qos);
+int mqtt_pub_fd(mqtt_broker *broker, const char *topic, int fd,
+                off_t offset, size_t len, mqtt_qos_t qos);
 int mqtt_sub(mqtt_broker *broker, const char *topic, mqtt_qos_t qos);
 int mqtt_unsub(mqtt_broker *broker, const char *topic);
 int mqtt_ping(mqtt_broker *broker);
@@ -81,4 +108,45 @@ int mqtt_get_data(mqtt_broker *broker, mqtt_data_t *data);
 int mqtt_disconnect(mqtt_broker *broker);
 int free_broker(mqtt_broker *broker);
 
+int mqtt_cache_enable(mqtt_broker *broker, int capacity);
+int mqtt_capture_start(mqtt_broker *broker, const char *path);
+int mqtt_capture_stop(mqtt_broker *broker);
+int mqtt_get_last(mqtt_broker *broker, const char *topic, mqtt_data_t *data);
+bool mqtt_data_pending(mqtt_broker *broker);
+
+int mqtt_set_callbacks(mqtt_broker *broker, mqtt_msg_cb on_msg,
+                       mqtt_ack_cb on_ack, void *arg);
+int mqtt_pub_async(mqtt_broker *broker,
+                   const char *topic, const char *msg,
+                   bool retain, bool dup, mqtt_qos_t qos);
+int mqtt_sub_async(mqtt_broker *broker, const char *topic, mqtt_qos_t qos);
+int mqtt_unsub_async(mqtt_broker *broker, const char *topic);
+int mqtt_ping_async(mqtt_broker *broker);
+int mqtt_poll(mqtt_broker *broker, int timeout_ms);
+bool mqtt_want_write(mqtt_broker *broker);
+
+int mqtt_set_backpressure(mqtt_broker *broker, size_t max_queued,
+                          size_t high_water, size_t low_water,
+                          mqtt_water_cb on_water, void *arg);
+int mqtt_set_rate_limit(mqtt_broker *broker, const char *topic,
+                        double rate, double burst);
+size_t mqtt_queued(mqtt_broker *broker);
+int mqtt_set_topic_priority(mqtt_broker *broker, const char *topic,
+                            mqtt_prio_t prio);
+
+int mqtt_set_low_latency(mqtt_broker *broker, int spin_us);
+int mqtt_pin_cpu(int cpu);
+
+mqtt_pool *mqtt_pool_create(int conns_per_slab);
+int mqtt_pool_destroy(mqtt_pool *pool);
+
+int mqtt_set_allocator(void *(*alloc_fn)(size_t),
+                       void *(*realloc_fn)(void *, size_t),
+                       void (*free_fn)(void *));
+void *mqtt_malloc(size_t size);
+void *mqtt_realloc(void *ptr, size_t size);
+void mqtt_free(void *ptr);
+
+bool mqtt_topic_matches(const char *filter, const char *topic);
+
 #endif // MQTT_H
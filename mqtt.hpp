@@ -0,0 +1,542 @@
+#ifndef MQTT_HPP
+#define MQTT_HPP
+
+/*
+ * C++20 coroutine layer over the MQTT publish and subscribe client.
+ * Header only, needs -std=c++20.
+ *
+ * Publish, subscribe and unsubscribe are awaitable and complete when the
+ * broker acknowledges them (PUBACK/PUBCOMP, SUBACK, UNSUBACK). Incoming
+ * messages are read through an async generator. Everything is driven by
+ * client::run_once or an event_loop over many clients, so a few threads
+ * can run any number of outstanding flows.
+ */
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+
+extern "C" {
+#include "mqtt.h"
+}
+
+namespace mqtt {
+
+/* Incoming message */
+struct message {
+    std::string topic;
+    std::string payload;
+    mqtt_qos_t qos;
+    bool retain;
+};
+
+namespace detail {
+
+struct promise_base {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    // resume whoever awaited the task
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<P> h) const noexcept {
+            return h.promise().continuation;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+    std::optional<T> value;
+
+    void return_value(T v) { value = std::move(v); }
+
+    T result() {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct promise<void> : promise_base {
+    void return_void() {}
+
+    void result() {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+} // namespace detail
+
+/*
+ * Lazily started coroutine, runs when awaited
+ */
+template <typename T = void>
+class task {
+public:
+    struct promise_type : detail::promise<T> {
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(
+                *this));
+        }
+    };
+
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    T await_resume() { return handle_.promise().result(); }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+// fire and forget coroutine, frees itself when done
+struct detached {
+    struct promise_type {
+        detached get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+inline detached run_detached(task<void> t) {
+    co_await std::move(t);
+}
+
+} // namespace detail
+
+/*
+ * Starts a task without awaiting it, it runs until its first suspension
+ */
+inline void spawn(task<void> t) {
+    detail::run_detached(std::move(t));
+}
+
+/*
+ * Async generator, the consumer pulls values with co_await next()
+ */
+template <typename T>
+class async_generator {
+public:
+    struct promise_type {
+        std::optional<T> current;
+        std::coroutine_handle<> consumer = std::noop_coroutine();
+        std::exception_ptr error;
+
+        // hand control back to the consumer
+        struct yield_awaiter {
+            bool await_ready() const noexcept { return false; }
+
+            std::coroutine_handle<>
+            await_suspend(std::coroutine_handle<promise_type> h)
+                const noexcept {
+                return h.promise().consumer;
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        async_generator get_return_object() {
+            return async_generator(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        yield_awaiter final_suspend() const noexcept { return {}; }
+
+        yield_awaiter yield_value(T value) {
+            current = std::move(value);
+            return {};
+        }
+
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {
+            error = std::current_exception();
+        }
+    };
+
+    struct next_awaiter {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() const noexcept { return false; }
+
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle.promise().consumer = awaiting;
+            handle.promise().current.reset();
+            return handle;
+        }
+
+        // empty once the generator is done
+        std::optional<T> await_resume() {
+            if (handle.promise().error)
+                std::rethrow_exception(handle.promise().error);
+            return std::move(handle.promise().current);
+        }
+    };
+
+    async_generator(async_generator &&other) noexcept
+        : handle_(std::exchange(other.handle_, {})) {}
+    async_generator(const async_generator &) = delete;
+    async_generator &operator=(const async_generator &) = delete;
+    ~async_generator() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    next_awaiter next() { return next_awaiter{handle_}; }
+
+private:
+    explicit async_generator(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/*
+ * Connection to a broker. Not thread safe, each client belongs to the
+ * thread running its event loop.
+ */
+class client {
+public:
+    client(const char *hostname, const char *client_id, uint16_t port,
+           uint8_t connect_flags = CLEAN_SESSION, uint8_t keep_alive = 60) {
+        if ((broker_ = mqtt_init(hostname, client_id, port)) == nullptr)
+            throw std::runtime_error("Unable to set up MQTT broker");
+        if (mqtt_connect(broker_, connect_flags, keep_alive) < 0) {
+            // mqtt_connect frees the broker on failure
+            broker_ = nullptr;
+            throw std::runtime_error("Unable to connect to MQTT broker");
+        }
+        mqtt_set_callbacks(broker_, on_msg, on_ack, this);
+    }
+
+    client(const client &) = delete;
+    client &operator=(const client &) = delete;
+
+    ~client() {
+        fail_all();
+        if (broker_ != nullptr) {
+            mqtt_disconnect(broker_);
+            free_broker(broker_);
+        }
+    }
+
+    mqtt_broker *broker() const noexcept { return broker_; }
+    int fd() const noexcept { return broker_->socket_fd; }
+    bool want_write() const noexcept { return mqtt_want_write(broker_); }
+
+    /* Outstanding acknowledgement */
+    struct pending_op {
+        bool done = false;
+        int status = 0;
+        std::coroutine_handle<> handle;
+    };
+
+    /*
+     * Awaitable completing with the ack status (0 or the granted QoS of a
+     * SUBACK), or -1 if the packet couldn't be sent or the connection failed.
+     * A publish completes with MQTT_WOULDBLOCK if the outbound queue is full
+     * or the topic is rate limited.
+     * The packet is sent when the awaitable is created, an ack arriving
+     * before it's awaited is kept until then.
+     */
+    class ack_awaiter {
+    public:
+        ack_awaiter(const ack_awaiter &) = delete;
+        ack_awaiter &operator=(const ack_awaiter &) = delete;
+        ~ack_awaiter() {
+            if (op_ != nullptr)
+                client_->release(key_, op_);
+        }
+
+        bool await_ready() const noexcept {
+            return op_ == nullptr || op_->done;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            op_->handle = handle;
+        }
+
+        int await_resume() {
+            if (op_ != nullptr) {
+                status_ = op_->status;
+                client_->release(key_, op_);
+                op_ = nullptr;
+            }
+            return status_;
+        }
+
+    private:
+        friend class client;
+
+        // already complete
+        explicit ack_awaiter(int status) : status_(status) {}
+
+        ack_awaiter(client *c, long key, pending_op *op)
+            : client_(c), key_(key), op_(op) {}
+
+        client *client_ = nullptr;
+        long key_ = 0;
+        pending_op *op_ = nullptr;
+        int status_ = 0;
+    };
+
+    ack_awaiter publish(const std::string &topic, const std::string &msg,
+                        mqtt_qos_t qos = QOS0, bool retain = false) {
+        int id = mqtt_pub_async(broker_, topic.c_str(), msg.c_str(),
+                                retain, false, qos);
+
+        if (id < 0)
+            return ack_awaiter(id);
+        else if (qos == QOS0)
+            return ack_awaiter(0);
+        return track(key(qos == QOS1 ? PUBACK : PUBCOMP, id));
+    }
+
+    ack_awaiter subscribe(const std::string &topic, mqtt_qos_t qos = QOS0) {
+        int id = mqtt_sub_async(broker_, topic.c_str(), qos);
+
+        if (id < 0)
+            return ack_awaiter(-1);
+        return track(key(SUBACK, id));
+    }
+
+    ack_awaiter unsubscribe(const std::string &topic) {
+        int id = mqtt_unsub_async(broker_, topic.c_str());
+
+        if (id < 0)
+            return ack_awaiter(-1);
+        return track(key(UNSUBACK, id));
+    }
+
+    ack_awaiter ping() {
+        if (mqtt_ping_async(broker_) < 0)
+            return ack_awaiter(-1);
+        return track(key(PINGRESP, 0));
+    }
+
+    /*
+     * Awaitable for the next incoming message, empty once the connection
+     * failed
+     */
+    class message_awaiter {
+    public:
+        bool await_ready() {
+            if (!client_->inbox_.empty()) {
+                msg_ = std::move(client_->inbox_.front());
+                client_->inbox_.pop_front();
+                return true;
+            }
+            return client_->failed_;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            handle_ = handle;
+            client_->readers_.push_back(this);
+        }
+
+        std::optional<message> await_resume() { return std::move(msg_); }
+
+    private:
+        friend class client;
+
+        explicit message_awaiter(client *c) : client_(c) {}
+
+        client *client_;
+        std::optional<message> msg_;
+        std::coroutine_handle<> handle_;
+    };
+
+    message_awaiter next_message() { return message_awaiter(this); }
+
+    async_generator<message> messages() {
+        while (auto msg = co_await next_message())
+            co_yield std::move(*msg);
+    }
+
+    /*
+     * Runs one event loop iteration, then resumes the coroutines whose
+     * acks or messages arrived. Returns mqtt_poll's result.
+     */
+    int run_once(int timeout_ms = 0) {
+        int ret = mqtt_poll(broker_, timeout_ms);
+
+        if (ret < 0)
+            fail_all();
+
+        // resume outside of the C callbacks, coroutines may poll again
+        std::vector<std::coroutine_handle<>> ready;
+        ready.swap(ready_);
+        for (auto handle : ready)
+            handle.resume();
+
+        return ret;
+    }
+
+private:
+    static long key(control_packet_t type, int id) {
+        return ((long)type << 16) | (id & 0xffff);
+    }
+
+    ack_awaiter track(long k) {
+        auto it = pending_.emplace(k, pending_op{});
+        return ack_awaiter(this, k, &it->second);
+    }
+
+    void release(long k, pending_op *op) {
+        auto range = pending_.equal_range(k);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (&it->second == op) {
+                pending_.erase(it);
+                return;
+            }
+        }
+    }
+
+    static void on_msg(mqtt_broker *, const mqtt_data_t *data, void *arg) {
+        client *self = static_cast<client *>(arg);
+        message msg{std::string(data->topic, data->topic_len),
+                    std::string(data->payload, data->payload_len),
+                    data->qos, data->retain};
+
+        if (!self->readers_.empty()) {
+            message_awaiter *reader = self->readers_.front();
+            self->readers_.pop_front();
+            reader->msg_ = std::move(msg);
+            self->ready_.push_back(reader->handle_);
+        }
+        else {
+            self->inbox_.push_back(std::move(msg));
+        }
+    }
+
+    // PINGRESP has no packet id, outstanding pings complete in order
+    static void on_ack(mqtt_broker *, control_packet_t type,
+                       uint16_t packet_id, int status, void *arg) {
+        client *self = static_cast<client *>(arg);
+        auto range = self->pending_.equal_range(key(type, packet_id));
+
+        for (auto it = range.first; it != range.second; ++it) {
+            pending_op &op = it->second;
+            if (op.done)
+                continue;
+            op.done = true;
+            op.status = (status == FAILURE) ? -1 : status;
+            if (op.handle)
+                self->ready_.push_back(op.handle);
+            return;
+        }
+    }
+
+    // connection failed, complete everything that waits on it
+    void fail_all() {
+        failed_ = true;
+        for (auto &entry : pending_) {
+            if (entry.second.done)
+                continue;
+            entry.second.done = true;
+            entry.second.status = -1;
+            if (entry.second.handle)
+                ready_.push_back(entry.second.handle);
+        }
+        for (auto *reader : readers_)
+            ready_.push_back(reader->handle_);
+        readers_.clear();
+    }
+
+    mqtt_broker *broker_;
+    bool failed_ = false;
+    std::unordered_multimap<long, pending_op> pending_;
+    std::deque<message> inbox_;
+    std::deque<message_awaiter *> readers_;
+    std::vector<std::coroutine_handle<>> ready_;
+};
+
+/*
+ * Event loop over many clients, one per thread
+ */
+class event_loop {
+public:
+    void add(client &c) { clients_.push_back(&c); }
+
+    /*
+     * Waits at most timeout_ms for any client socket, then runs the clients
+     * that are ready. Returns -1 if a client's connection failed.
+     */
+    int run_once(int timeout_ms) {
+        std::vector<struct pollfd> fds(clients_.size());
+        int ret = 0;
+
+        for (size_t i = 0; i < clients_.size(); i++) {
+            fds[i].fd = clients_[i]->fd();
+            fds[i].events = POLLIN | (clients_[i]->want_write() ? POLLOUT : 0);
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds.data(), fds.size(), timeout_ms) < 0)
+            return -1;
+
+        for (size_t i = 0; i < clients_.size(); i++) {
+            if (fds[i].revents != 0 && clients_[i]->run_once(0) < 0)
+                ret = -1;
+        }
+
+        return ret;
+    }
+
+    void run() {
+        stopped_ = false;
+        while (!stopped_ && run_once(100) >= 0) {}
+    }
+
+    void stop() noexcept { stopped_ = true; }
+
+private:
+    std::vector<client *> clients_;
+    bool stopped_ = false;
+};
+
+} // namespace mqtt
+
+#endif // MQTT_HPP
@@ -0,0 +1,634 @@
+/*
+ * Load generator for the MQTT publish and subscribe client.
+ * Written by Edward Lu
+ *
+ * Spreads many publishing and subscribing clients over a few threads, each
+ * thread driving its clients with the async API. Publishes carry their send
+ * time, subscribers use it to measure end-to-end latency.
+ *
+ * With -P it instead bounces one message at a time between two clients and
+ * reports the round trip times, first in the default mode and then in the
+ * busy polling low latency mode.
+ */
+
+#include "mqtt.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <string.h>
+
+#include <sys/resource.h>
+
+#define TOPIC_PREFIX    "bench/"
+#define STAMP_LEN       17          // 16 hex digits + ':'
+#define DRAIN_NS        2000000000ull   // wait for in-flight messages (2 sec)
+#define MAX_QUEUED      (1 << 20)   // per client, publishes past it are
+                                    // counted as would block
+#define HIST_SUB_BITS   5
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_LEN        ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define PING_TOPIC      TOPIC_PREFIX "ping"
+#define PONG_TOPIC      TOPIC_PREFIX "pong"
+
+/*
+ * Latency histogram in usec (nsec for ping-pong), log buckets with HIST_SUB
+ * linear steps each
+ */
+typedef struct {
+    uint64_t counts[HIST_LEN];
+    uint64_t total;
+    uint64_t max;
+} latency_hist;
+
+/* Options */
+typedef struct {
+    const char *host;
+    uint16_t port;
+    int threads;
+    int pubs;
+    int subs;
+    int topics;
+    double rate;                // publishes per second per publisher
+    int duration;               // sec
+    int min_size;               // payload size, uniform in [min, max]
+    int max_size;
+    int qos_mix[3];             // percent of QoS 0, 1 and 2
+    bool pingpong;
+    int spin_us;                // low latency spin budget, 0 for off
+    int cpu;                    // first CPU to pin ping-pong threads to
+} bench_opts;
+
+/* Simulated client */
+typedef struct {
+    mqtt_broker *broker;
+    bool sub;
+    uint64_t next_pub;
+} bench_client;
+
+/* Thread and the clients it drives */
+typedef struct {
+    int id;
+    pthread_t thread;
+    bench_client *clients;
+    int num_clients;
+    unsigned int seed;
+
+    uint64_t sent;
+    uint64_t wouldblock;
+    uint64_t acks;
+    uint64_t recvd;
+    uint64_t errors;
+    latency_hist hist;
+} bench_thread;
+
+static bench_opts opts = {
+    "127.0.0.1", 1883, 4, 100, 10, 10, 10, 10, 64, 64, { 100, 0, 0 },
+    false, 0, -1
+};
+static atomic_int threads_ready;
+static atomic_bool go;
+static uint64_t start_ns, end_ns;
+
+/* Small helper functions */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double cpu_sec(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Histogram helpers
+ */
+static int hist_index(uint64_t v) {
+    int msb, shift;
+
+    if (v < HIST_SUB) {
+        return v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+static uint64_t hist_value(int idx) {
+    int shift = idx / HIST_SUB - 1;
+
+    if (shift < 0) {
+        return idx;
+    }
+    return (uint64_t)(HIST_SUB + idx % HIST_SUB) << shift;
+}
+
+static void hist_add(latency_hist *hist, uint64_t v) {
+    hist->counts[hist_index(v)]++;
+    hist->total++;
+    if (v > hist->max)
+        hist->max = v;
+}
+
+static void hist_merge(latency_hist *dst, const latency_hist *src) {
+    for (int i = 0; i < HIST_LEN; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const latency_hist *hist, double pct) {
+    uint64_t rank = (uint64_t)(hist->total * pct / 100), seen = 0;
+
+    for (int i = 0; i < HIST_LEN; i++) {
+        seen += hist->counts[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return hist->max;
+}
+
+/*
+ * Callbacks, arg is the bench_thread of the client
+ */
+static void on_msg(mqtt_broker *broker, const mqtt_data_t *data, void *arg) {
+    bench_thread *t = (bench_thread *)arg;
+    uint64_t sent_ns = strtoull(data->payload, NULL, 16), now = now_ns();
+
+    t->recvd++;
+    if (sent_ns > 0 && sent_ns <= now)
+        hist_add(&t->hist, (now - sent_ns) / 1000);
+}
+
+static void on_ack(mqtt_broker *broker, control_packet_t type,
+                   uint16_t packet_id, int status, void *arg) {
+    if (type == PUBACK || type == PUBCOMP)
+        ((bench_thread *)arg)->acks++;
+}
+
+/*
+ * Publishes one message with a random topic, size and QoS
+ */
+static void bench_publish(bench_thread *t, bench_client *c, char *payload) {
+    char topic[32];
+    int size = opts.min_size, pct, ret;
+    mqtt_qos_t qos = QOS0;
+
+    if (opts.max_size > opts.min_size)
+        size += rand_r(&t->seed) % (opts.max_size - opts.min_size + 1);
+
+    pct = rand_r(&t->seed) % 100;
+    if (pct >= opts.qos_mix[0])
+        qos = (pct < opts.qos_mix[0] + opts.qos_mix[1]) ? QOS1 : QOS2;
+
+    snprintf(topic, sizeof(topic), TOPIC_PREFIX "%d",
+             rand_r(&t->seed) % opts.topics);
+
+    // send time goes first, the rest is filler
+    snprintf(payload, STAMP_LEN + 1, "%016llx:",
+             (unsigned long long)now_ns());
+    payload[STAMP_LEN] = 'x';
+    payload[size] = '\0';
+
+    ret = mqtt_pub_async(c->broker, topic, payload, false, false, qos);
+    payload[size] = 'x';
+
+    if (ret == MQTT_WOULDBLOCK)
+        t->wouldblock++;
+    else if (ret < 0)
+        t->errors++;
+    else
+        t->sent++;
+}
+
+/*
+ * Connects the thread's clients, subscribers subscribe before the start
+ */
+static void bench_connect(bench_thread *t) {
+    char client_id[CLIENTID_LEN], topic[32];
+
+    for (int i = 0; i < t->num_clients; i++) {
+        bench_client *c = &t->clients[i];
+
+        snprintf(client_id, sizeof(client_id), "b%d_%d_%d",
+                 (int)getpid() % 100000, t->id, i);
+        if ((c->broker = mqtt_init(opts.host, client_id, opts.port)) == NULL ||
+            mqtt_connect(c->broker, CLEAN_SESSION, 60) < 0) {
+            c->broker = NULL;
+            t->errors++;
+            continue;
+        }
+
+        if (c->sub) {
+            // spread subscribers over the topics, fan-out is subs / topics
+            snprintf(topic, sizeof(topic), TOPIC_PREFIX "%d",
+                     (t->id + i * opts.threads) % opts.topics);
+            if (mqtt_sub(c->broker, topic, QOS2) < 0) {
+                t->errors++;
+            }
+        }
+
+        mqtt_set_callbacks(c->broker, on_msg, on_ack, t);
+        mqtt_set_backpressure(c->broker, MAX_QUEUED, 0, 0, NULL, NULL);
+    }
+}
+
+static void *bench_run(void *arg) {
+    bench_thread *t = (bench_thread *)arg;
+    struct pollfd *pfds;
+    int *idx;
+    char *payload;
+    uint64_t interval = (uint64_t)(1e9 / opts.rate), now;
+
+    pfds = (struct pollfd *)calloc(t->num_clients + 1,
+                                   sizeof(struct pollfd));
+    idx = (int *)calloc(t->num_clients + 1, sizeof(int));
+    payload = (char *)malloc(opts.max_size + 1);
+    if (pfds == NULL || idx == NULL || payload == NULL) {
+        fprintf(stderr, "Unable to allocate thread state\n");
+        exit(1);
+    }
+    memset(payload, 'x', opts.max_size + 1);
+
+    bench_connect(t);
+
+    atomic_fetch_add(&threads_ready, 1);
+    while (!atomic_load(&go))
+        usleep(1000);
+
+    // stagger publishers over one interval
+    for (int i = 0; i < t->num_clients; i++)
+        t->clients[i].next_pub = start_ns + rand_r(&t->seed) % interval;
+
+    while ((now = now_ns()) < end_ns + DRAIN_NS) {
+        uint64_t next_due = now + 10000000; // poll at least every 10 ms
+        int n = 0, timeout_ms;
+
+        for (int i = 0; i < t->num_clients; i++) {
+            bench_client *c = &t->clients[i];
+
+            if (c->broker == NULL)
+                continue;
+
+            if (!c->sub && now < end_ns) {
+                while (c->next_pub <= now) {
+                    bench_publish(t, c, payload);
+                    c->next_pub += interval;
+                }
+                if (c->next_pub < next_due)
+                    next_due = c->next_pub;
+            }
+
+            pfds[n].fd = c->broker->socket_fd;
+            pfds[n].events = POLLIN |
+                             (mqtt_want_write(c->broker) ? POLLOUT : 0);
+            idx[n++] = i;
+        }
+
+        timeout_ms = (next_due > now) ? (next_due - now) / 1000000 : 0;
+        if (poll(pfds, n, timeout_ms) <= 0)
+            continue;
+
+        for (int i = 0; i < n; i++) {
+            bench_client *c = &t->clients[idx[i]];
+
+            if (pfds[i].revents == 0)
+                continue;
+            if (mqtt_poll(c->broker, 0) < 0) {
+                t->errors++;
+                free_broker(c->broker);
+                c->broker = NULL;
+            }
+        }
+    }
+
+    for (int i = 0; i < t->num_clients; i++) {
+        if (t->clients[i].broker != NULL) {
+            mqtt_disconnect(t->clients[i].broker);
+            free_broker(t->clients[i].broker);
+        }
+    }
+
+    free(pfds);
+    free(idx);
+    free(payload);
+
+    return NULL;
+}
+
+/*
+ * Echoes pings back until stopped, runs on its own thread
+ */
+static atomic_bool pong_stop;
+
+static void *pong_run(void *arg) {
+    mqtt_broker *broker = (mqtt_broker *)arg;
+    mqtt_data_t *data = (mqtt_data_t *)malloc(sizeof(mqtt_data_t));
+    char msg[sizeof(data->payload) + 1]; // payload can fill its buffer
+    size_t len;
+
+    if (opts.cpu >= 0)
+        mqtt_pin_cpu(opts.cpu + 1);
+
+    while (data != NULL && !atomic_load(&pong_stop)) {
+        if (mqtt_get_data(broker, data) < 0)
+            break;
+        len = (data->payload_len < 0) ? 0 : (size_t)data->payload_len;
+        if (len > sizeof(data->payload))
+            len = sizeof(data->payload);
+        memcpy(msg, data->payload, len);
+        msg[len] = '\0';
+        if (mqtt_pub(broker, PONG_TOPIC, msg, false, false, QOS0) < 0)
+            break;
+    }
+
+    free(data);
+    return NULL;
+}
+
+static mqtt_broker *pingpong_client(const char *name, const char *topic,
+                                    bool low_latency) {
+    char client_id[CLIENTID_LEN];
+    mqtt_broker *broker;
+
+    snprintf(client_id, sizeof(client_id), "b%d_%s",
+             (int)getpid() % 100000, name);
+    if ((broker = mqtt_init(opts.host, client_id, opts.port)) == NULL) {
+        return NULL;
+    }
+    if (mqtt_connect(broker, CLEAN_SESSION, 60) < 0 ||
+        mqtt_sub(broker, topic, QOS0) < 0 ||
+        (low_latency && mqtt_set_low_latency(broker, opts.spin_us) < 0)) {
+        free_broker(broker);
+        return NULL;
+    }
+    return broker;
+}
+
+/*
+ * One ping-pong round, returns -1 if the clients couldn't connect
+ */
+static int pingpong(bool low_latency, latency_hist *hist) {
+    mqtt_broker *ping, *pong;
+    mqtt_data_t *data;
+    pthread_t thread;
+    char payload[STAMP_LEN + 1];
+    uint64_t end, sent;
+    int ret = 0;
+
+    ping = pingpong_client("ping", PONG_TOPIC, low_latency);
+    pong = pingpong_client("pong", PING_TOPIC, low_latency);
+    data = (mqtt_data_t *)malloc(sizeof(mqtt_data_t));
+    if (ping == NULL || pong == NULL || data == NULL) {
+        fprintf(stderr, "Unable to connect ping-pong clients\n");
+        exit(1);
+    }
+
+    atomic_store(&pong_stop, false);
+    if (pthread_create(&thread, NULL, pong_run, pong) != 0) {
+        fprintf(stderr, "Unable to start thread\n");
+        exit(1);
+    }
+    if (opts.cpu >= 0)
+        mqtt_pin_cpu(opts.cpu);
+
+    end = now_ns() + (uint64_t)opts.duration * 1000000000;
+    while ((sent = now_ns()) < end) {
+        snprintf(payload, sizeof(payload), "%016llx:",
+                 (unsigned long long)sent);
+        if (mqtt_pub(ping, PING_TOPIC, payload, false, false, QOS0) < 0 ||
+            mqtt_get_data(ping, data) < 0) {
+            ret = -1;
+            break;
+        }
+        hist_add(hist, now_ns() - sent);
+    }
+
+    // one more ping wakes the echo thread up to see the stop flag
+    atomic_store(&pong_stop, true);
+    mqtt_pub(ping, PING_TOPIC, "0", false, false, QOS0);
+    pthread_join(thread, NULL);
+
+    mqtt_disconnect(ping);
+    mqtt_disconnect(pong);
+    free_broker(ping);
+    free_broker(pong);
+    free(data);
+
+    return ret;
+}
+
+static void pingpong_report(const char *mode, const latency_hist *hist,
+                            double cpu) {
+    printf("%-12s %llu round trips, rtt usec p50 %.1f p99 %.1f "
+           "p99.9 %.1f max %.1f, cpu %.2f sec\n", mode,
+           (unsigned long long)hist->total,
+           hist_percentile(hist, 50) / 1e3, hist_percentile(hist, 99) / 1e3,
+           hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3, cpu);
+}
+
+static int pingpong_main(void) {
+    latency_hist *hist = (latency_hist *)calloc(2, sizeof(latency_hist));
+    char mode[32];
+    double cpu;
+
+    if (hist == NULL) {
+        fprintf(stderr, "Unable to allocate histograms\n");
+        return 1;
+    }
+
+    printf("ping-pong, %d sec per mode\n", opts.duration);
+    if (opts.spin_us == 0)
+        printf("low latency mode off, enable it with -L spin_us\n");
+
+    cpu = cpu_sec();
+    if (pingpong(false, &hist[0]) < 0)
+        fprintf(stderr, "Default mode round trips failed\n");
+    pingpong_report("default", &hist[0], cpu_sec() - cpu);
+
+    // spinning burns a core per client, so only when asked for
+    if (opts.spin_us > 0) {
+        cpu = cpu_sec();
+        if (pingpong(true, &hist[1]) < 0)
+            fprintf(stderr, "Low latency round trips failed\n");
+        snprintf(mode, sizeof(mode), "spin %d us", opts.spin_us);
+        pingpong_report(mode, &hist[1], cpu_sec() - cpu);
+    }
+
+    free(hist);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-h host] [-p port] [-t threads] [-c publishers]\n"
+            "       [-s subscribers] [-T topics] [-r rate] [-d duration]\n"
+            "       [-l size | -l min:max] [-q qos0:qos1:qos2]\n"
+            "       %s -P [-h host] [-p port] [-d duration] [-L spin_us]\n"
+            "       [-C cpu]\n", prog, prog);
+    exit(1);
+}
+
+/*
+ * Parses command line options
+ */
+static void parse_opts(int argc, char **argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:t:c:s:T:r:d:l:q:PL:C:")) != -1) {
+        switch (opt) {
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 't': opts.threads = atoi(optarg); break;
+        case 'c': opts.pubs = atoi(optarg); break;
+        case 's': opts.subs = atoi(optarg); break;
+        case 'T': opts.topics = atoi(optarg); break;
+        case 'r': opts.rate = atof(optarg); break;
+        case 'd': opts.duration = atoi(optarg); break;
+        case 'l':
+            if (sscanf(optarg, "%d:%d", &opts.min_size, &opts.max_size) != 2)
+                opts.max_size = opts.min_size;
+            break;
+        case 'q':
+            if (sscanf(optarg, "%d:%d:%d", &opts.qos_mix[0],
+                       &opts.qos_mix[1], &opts.qos_mix[2]) != 3)
+                usage(argv[0]);
+            break;
+        case 'P': opts.pingpong = true; break;
+        case 'L': opts.spin_us = atoi(optarg); break;
+        case 'C': opts.cpu = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (opts.threads < 1 || opts.pubs < 0 || opts.subs < 0 ||
+        opts.topics < 1 || opts.duration < 1 ||
+        opts.rate <= 0 || opts.rate > 1e9 || // interval of at least 1 ns
+        opts.min_size > opts.max_size ||
+        opts.qos_mix[0] + opts.qos_mix[1] + opts.qos_mix[2] != 100 ||
+        opts.spin_us < 0) {
+        usage(argv[0]);
+    }
+
+    // room for the send time
+    if (opts.min_size < STAMP_LEN)
+        opts.min_size = STAMP_LEN;
+    if (opts.max_size < opts.min_size)
+        opts.max_size = opts.min_size;
+}
+
+int main(int argc, char **argv) {
+    bench_thread *threads;
+    bench_client *clients;
+    latency_hist *hist;
+    struct rlimit rl;
+    uint64_t sent = 0, wouldblock = 0, acks = 0, recvd = 0, errors = 0;
+    int num_clients;
+    double cpu;
+
+    parse_opts(argc, argv);
+    if (opts.pingpong) {
+        return pingpong_main();
+    }
+    num_clients = opts.pubs + opts.subs;
+
+    // one socket per client
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    threads = (bench_thread *)calloc(opts.threads, sizeof(bench_thread));
+    clients = (bench_client *)calloc(num_clients, sizeof(bench_client));
+    hist = (latency_hist *)calloc(1, sizeof(latency_hist));
+    if (threads == NULL || clients == NULL || hist == NULL) {
+        fprintf(stderr, "Unable to allocate clients\n");
+        return 1;
+    }
+
+    for (int i = 0, first = 0; i < opts.threads; i++) {
+        int n = num_clients / opts.threads +
+                (i < num_clients % opts.threads);
+        threads[i].id = i;
+        threads[i].seed = i + 1;
+        threads[i].clients = &clients[first];
+        threads[i].num_clients = n;
+        first += n;
+    }
+
+    // deal subscribers round robin so every thread gets both kinds
+    for (int i = 0; i < opts.subs; i++) {
+        bench_thread *t = &threads[i % opts.threads];
+        t->clients[i / opts.threads].sub = true;
+    }
+
+    for (int i = 0; i < opts.threads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, bench_run,
+                           &threads[i]) != 0) {
+            fprintf(stderr, "Unable to start thread\n");
+            return 1;
+        }
+    }
+
+    while (atomic_load(&threads_ready) < opts.threads)
+        usleep(1000);
+
+    cpu = cpu_sec();
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t)opts.duration * 1000000000;
+    atomic_store(&go, true);
+
+    for (int i = 0; i < opts.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        sent += threads[i].sent;
+        wouldblock += threads[i].wouldblock;
+        acks += threads[i].acks;
+        recvd += threads[i].recvd;
+        errors += threads[i].errors;
+        hist_merge(hist, &threads[i].hist);
+    }
+    cpu = cpu_sec() - cpu;
+
+    printf("%d publishers, %d subscribers, %d topics, %d threads, "
+           "%d sec\n", opts.pubs, opts.subs, opts.topics, opts.threads,
+           opts.duration);
+    printf("published %llu (%.0f msg/sec), %llu would block, "
+           "%llu acknowledged, %llu errors\n", (unsigned long long)sent,
+           sent / (double)opts.duration, (unsigned long long)wouldblock,
+           (unsigned long long)acks, (unsigned long long)errors);
+    printf("received %llu (%.0f msg/sec)\n", (unsigned long long)recvd,
+           recvd / (double)opts.duration);
+    if (hist->total > 0) {
+        printf("latency usec p50 %llu p90 %llu p99 %llu p99.9 %llu "
+               "max %llu\n",
+               (unsigned long long)hist_percentile(hist, 50),
+               (unsigned long long)hist_percentile(hist, 90),
+               (unsigned long long)hist_percentile(hist, 99),
+               (unsigned long long)hist_percentile(hist, 99.9),
+               (unsigned long long)hist->max);
+    }
+    if (sent + recvd > 0) {
+        printf("cpu %.2f sec, %.2f usec/msg\n", cpu,
+               cpu * 1e6 / (sent + recvd));
+    }
+
+    free(threads);
+    free(clients);
+    free(hist);
+
+    return 0;
+}
@@ -0,0 +1,348 @@
+/*
+ * Last-value cache for the MQTT publish and subscribe client.
+ * Written by Edward Lu
+ */
+
+#include "mqtt_cache.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <string.h>
+
+#define EMPTY   -1
+
+/*
+ * FNV-1a hash of a topic name
+ */
+static uint32_t topic_hash(const char *topic) {
+    uint32_t hash = 2166136261u;
+
+    while (*topic != '\0') {
+        hash ^= (uint8_t)*topic++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * LRU list helpers
+ */
+static void lru_unlink(mqtt_cache *cache, int idx) {
+    cache_entry *entry = &cache->entries[idx];
+
+    if (entry->prev != EMPTY)
+        cache->entries[entry->prev].next = entry->next;
+    else
+        cache->lru_head = entry->next;
+
+    if (entry->next != EMPTY)
+        cache->entries[entry->next].prev = entry->prev;
+    else
+        cache->lru_tail = entry->prev;
+}
+
+static void lru_push_front(mqtt_cache *cache, int idx) {
+    cache_entry *entry = &cache->entries[idx];
+
+    entry->prev = EMPTY;
+    entry->next = cache->lru_head;
+    if (cache->lru_head != EMPTY)
+        cache->entries[cache->lru_head].prev = idx;
+    else
+        cache->lru_tail = idx;
+    cache->lru_head = idx;
+}
+
+static void lru_touch(mqtt_cache *cache, int idx) {
+    if (cache->lru_head != idx) {
+        lru_unlink(cache, idx);
+        lru_push_front(cache, idx);
+    }
+}
+
+/*
+ * Hash table helpers
+ */
+
+/*
+ * Returns the table slot holding topic, or the empty slot where it belongs
+ */
+static uint32_t table_find(mqtt_cache *cache, const char *topic,
+                           uint32_t hash) {
+    uint32_t slot = hash & cache->table_mask;
+
+    while (cache->table[slot] != EMPTY) {
+        cache_entry *entry = &cache->entries[cache->table[slot]];
+        if (entry->hash == hash && strcmp(entry->data.topic, topic) == 0)
+            break;
+        slot = (slot + 1) & cache->table_mask;
+    }
+
+    return slot;
+}
+
+/*
+ * Removes a slot with backward shift deletion, so no tombstones are needed
+ */
+static void table_remove(mqtt_cache *cache, uint32_t slot) {
+    uint32_t next = (slot + 1) & cache->table_mask;
+
+    while (cache->table[next] != EMPTY) {
+        uint32_t home = cache->entries[cache->table[next]].hash &
+                        cache->table_mask;
+        // move next back if its home slot is not between slot and next
+        if (((next - home) & cache->table_mask) >=
+            ((next - slot) & cache->table_mask)) {
+            cache->table[slot] = cache->table[next];
+            slot = next;
+        }
+        next = (next + 1) & cache->table_mask;
+    }
+
+    cache->table[slot] = EMPTY;
+}
+
+/*
+ * Creates a cache holding at most capacity topics
+ */
+mqtt_cache *mqtt_cache_create(int capacity) {
+    uint32_t table_len = 1;
+    mqtt_cache *cache;
+
+    if (capacity <= 0) {
+        return NULL;
+    }
+
+    // keep load factor at or below 0.5
+    while (table_len < 2 * (uint32_t)capacity)
+        table_len <<= 1;
+
+    if ((cache = (mqtt_cache *)mqtt_malloc(sizeof(mqtt_cache))) == NULL) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(mqtt_cache));
+
+    cache->table = (int *)mqtt_malloc(table_len * sizeof(int));
+    cache->entries = (cache_entry *)mqtt_malloc(capacity *
+                                                sizeof(cache_entry));
+    cache->pending = (cache_pending *)mqtt_malloc(capacity *
+                                                  sizeof(cache_pending));
+    if (cache->table == NULL || cache->entries == NULL ||
+        cache->pending == NULL) {
+        mqtt_cache_free(cache);
+        return NULL;
+    }
+    memset(cache->entries, 0, capacity * sizeof(cache_entry));
+
+    cache->capacity = capacity;
+    cache->table_mask = table_len - 1;
+    memset(cache->table, EMPTY, table_len * sizeof(int));
+
+    cache->lru_head = EMPTY;
+    cache->lru_tail = EMPTY;
+    for (int i = 0; i < capacity; i++)
+        cache->entries[i].next = (i + 1 < capacity) ? i + 1 : EMPTY;
+    cache->free_head = 0;
+
+    return cache;
+}
+
+/*
+ * Frees memory taken by cache
+ */
+void mqtt_cache_free(mqtt_cache *cache) {
+    if (cache != NULL) {
+        mqtt_free(cache->table);
+        mqtt_free(cache->entries);
+        mqtt_free(cache->pending);
+        mqtt_free(cache);
+    }
+}
+
+/*
+ * Records a message as the latest value of its topic. An empty payload
+ * clears the retained value on the broker, which forwards it to subscribers
+ * without the retain flag, so it removes the topic instead.
+ */
+void mqtt_cache_put(mqtt_cache *cache, const mqtt_data_t *data) {
+    uint32_t hash = topic_hash(data->topic);
+    uint32_t slot = table_find(cache, data->topic, hash);
+    cache_entry *entry;
+    int idx = cache->table[slot];
+
+    if (data->payload_len == 0) {
+        if (idx != EMPTY) {
+            entry = &cache->entries[idx];
+            lru_unlink(cache, idx);
+            table_remove(cache, slot);
+            entry->in_use = false;
+            entry->serial++;    // drop pending deliveries of the old value
+            entry->next = cache->free_head;
+            cache->free_head = idx;
+            cache->count--;
+        }
+        return;
+    }
+
+    if (idx != EMPTY) {
+        entry = &cache->entries[idx];
+        lru_touch(cache, idx);
+    }
+    else {
+        if (cache->free_head != EMPTY) {
+            idx = cache->free_head;
+            cache->free_head = cache->entries[idx].next;
+            cache->count++;
+        }
+        else {
+            // evict least recently used topic
+            idx = cache->lru_tail;
+            entry = &cache->entries[idx];
+            lru_unlink(cache, idx);
+            table_remove(cache, table_find(cache, entry->data.topic,
+                                           entry->hash));
+            // the hole may have moved our slot
+            slot = table_find(cache, data->topic, hash);
+        }
+
+        entry = &cache->entries[idx];
+        entry->in_use = true;
+        entry->retained = false;
+        entry->hash = hash;
+        entry->serial++;
+        cache->table[slot] = idx;
+        lru_push_front(cache, idx);
+    }
+
+    // brokers clear the retain flag of messages to existing subscriptions,
+    // so after a live message the broker's retained value is unknown
+    entry->retained = data->retain;
+    memcpy(&entry->data, data, sizeof(mqtt_data_t));
+}
+
+/*
+ * Gets the latest value of a topic, returns -1 if not cached
+ */
+int mqtt_cache_get(mqtt_cache *cache, const char *topic, mqtt_data_t *data) {
+    uint32_t hash = topic_hash(topic);
+    int idx = cache->table[table_find(cache, topic, hash)];
+
+    if (idx == EMPTY) {
+        return -1;
+    }
+
+    lru_touch(cache, idx);
+    memcpy(data, &cache->entries[idx].data, sizeof(mqtt_data_t));
+
+    return 0;
+}
+
+/*
+ * Subscription tracking
+ */
+bool mqtt_cache_subscribed(mqtt_cache *cache, const char *filter,
+                           mqtt_qos_t qos) {
+    for (int i = 0; i < cache->num_subs; i++) {
+        if (strcmp(cache->subs[i], filter) == 0)
+            return cache->sub_qos[i] >= qos;
+    }
+    return false;
+}
+
+void mqtt_cache_sub(mqtt_cache *cache, const char *filter, mqtt_qos_t qos) {
+    for (int i = 0; i < cache->num_subs; i++) {
+        if (strcmp(cache->subs[i], filter) == 0) {
+            cache->sub_qos[i] = qos;
+            return;
+        }
+    }
+
+    // untracked filters always go to the broker
+    if (cache->num_subs < CACHE_MAX_SUBS && strlen(filter) < MAXPACKET_LEN) {
+        strcpy(cache->subs[cache->num_subs], filter);
+        cache->sub_qos[cache->num_subs] = qos;
+        cache->num_subs++;
+    }
+}
+
+void mqtt_cache_unsub(mqtt_cache *cache, const char *filter) {
+    for (int i = 0; i < cache->num_subs; i++) {
+        if (strcmp(cache->subs[i], filter) == 0) {
+            cache->num_subs--;
+            if (i != cache->num_subs) {
+                strcpy(cache->subs[i], cache->subs[cache->num_subs]);
+                cache->sub_qos[i] = cache->sub_qos[cache->num_subs];
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Checks if the cache holds everything the broker would resend on SUBSCRIBE
+ * to filter. Entries of wildcard filters may have been evicted, so only a
+ * topic name with its retained value cached qualifies.
+ */
+bool mqtt_cache_complete(mqtt_cache *cache, const char *filter) {
+    uint32_t hash = topic_hash(filter);
+    int idx;
+
+    if (strpbrk(filter, "+#") != NULL) {
+        return false;
+    }
+
+    idx = cache->table[table_find(cache, filter, hash)];
+    return idx != EMPTY && cache->entries[idx].retained;
+}
+
+/*
+ * Queues the retained values matching filter for delivery, the same way
+ * the broker resends them on SUBSCRIBE. Returns number of queued values.
+ */
+int mqtt_cache_queue_retained(mqtt_cache *cache, const char *filter) {
+    int queued = 0;
+
+    for (int idx = cache->lru_head; idx != EMPTY;
+         idx = cache->entries[idx].next) {
+        cache_entry *entry = &cache->entries[idx];
+
+        if (cache->pending_len == cache->capacity)
+            break;
+        if (!entry->retained || !mqtt_topic_matches(filter, entry->data.topic))
+            continue;
+
+        int tail = (cache->pending_head + cache->pending_len) %
+                   cache->capacity;
+        cache->pending[tail].idx = idx;
+        cache->pending[tail].serial = entry->serial;
+        cache->pending_len++;
+        queued++;
+    }
+
+    return queued;
+}
+
+/*
+ * Pops the next queued value, returns -1 if there is none
+ */
+int mqtt_cache_pop_pending(mqtt_cache *cache, mqtt_data_t *data) {
+    while (cache->pending_len > 0) {
+        cache_pending *pending = &cache->pending[cache->pending_head];
+        cache_entry *entry = &cache->entries[pending->idx];
+
+        cache->pending_head = (cache->pending_head + 1) % cache->capacity;
+        cache->pending_len--;
+
+        // skip values evicted since they were queued
+        if (entry->in_use && entry->serial == pending->serial) {
+            memcpy(data, &entry->data, sizeof(mqtt_data_t));
+            data->msg_id = -1; // already acknowledged when first received
+            data->retain = true;
+            return 0;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,71 @@
+#ifndef MQTT_CACHE_H
+#define MQTT_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mqtt.h"
+
+/*
+ * Client side last-value cache, keyed by topic name.
+ * Open-addressed hash table (linear probing) over a fixed pool of entries,
+ * evicting the least recently used entry once the pool is full.
+ */
+
+#define CACHE_MAX_SUBS  32      // tracked subscriptions per connection
+
+/* Cache entry */
+typedef struct {
+    mqtt_data_t data;
+    uint32_t hash;
+    uint32_t serial;            // bumped every time the entry is reused
+    int prev;                   // LRU list, more recently used
+    int next;                   // LRU list, less recently used
+    bool in_use;
+    bool retained;              // broker sent this topic as a retained value
+} cache_entry;
+
+/* Pending delivery, checked against serial since entries can be evicted */
+typedef struct {
+    int idx;
+    uint32_t serial;
+} cache_pending;
+
+struct mqtt_cache {
+    int capacity;
+    int count;
+    uint32_t table_mask;
+    int *table;                 // entry index, -1 if empty
+    cache_entry *entries;
+    int lru_head;               // most recently used
+    int lru_tail;               // least recently used
+    int free_head;              // unused entries, linked through next
+
+    // cached values waiting to be returned by mqtt_get_data
+    cache_pending *pending;
+    int pending_head;
+    int pending_len;
+
+    // filters this connection is subscribed to on the broker
+    int num_subs;
+    mqtt_qos_t sub_qos[CACHE_MAX_SUBS];
+    char subs[CACHE_MAX_SUBS][MAXPACKET_LEN];
+};
+
+typedef struct mqtt_cache mqtt_cache;
+
+mqtt_cache *mqtt_cache_create(int capacity);
+void mqtt_cache_free(mqtt_cache *cache);
+void mqtt_cache_put(mqtt_cache *cache, const mqtt_data_t *data);
+int mqtt_cache_get(mqtt_cache *cache, const char *topic, mqtt_data_t *data);
+
+bool mqtt_cache_subscribed(mqtt_cache *cache, const char *filter,
+                           mqtt_qos_t qos);
+void mqtt_cache_sub(mqtt_cache *cache, const char *filter, mqtt_qos_t qos);
+void mqtt_cache_unsub(mqtt_cache *cache, const char *filter);
+bool mqtt_cache_complete(mqtt_cache *cache, const char *filter);
+
+int mqtt_cache_queue_retained(mqtt_cache *cache, const char *filter);
+int mqtt_cache_pop_pending(mqtt_cache *cache, mqtt_data_t *data);
+
+#endif // MQTT_CACHE_H
@@ -0,0 +1,282 @@
+/*
+ * Packet capture for the MQTT publish and subscribe client.
+ * Written by Edward Lu
+ */
+
+#include "mqtt_capture.h"
+#include "mqtt.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VERBOSE 1
+
+#define CAPTURE_MAP_LEN (1 << 20)   // initial file size, doubled when full
+
+/* Small helper functions */
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t rec_size(uint32_t len) {
+    return (sizeof(capture_rec) + len + 7) & ~(size_t)7;
+}
+
+/*
+ * Maps len bytes of the file
+ */
+static int capture_mmap(mqtt_capture *cap, size_t len) {
+    int prot = PROT_READ | (cap->writable ? PROT_WRITE : 0);
+    char *map = (char *)mmap(NULL, len, prot, MAP_SHARED, cap->fd, 0);
+
+    if (map == MAP_FAILED) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to map capture file\n");
+        return -1;
+    }
+    cap->map = map;
+    cap->map_len = len;
+
+    return 0;
+}
+
+/*
+ * Grows the file to hold at least need bytes
+ */
+static int capture_grow(mqtt_capture *cap, size_t need) {
+    size_t new_len = cap->map_len;
+
+    while (new_len < need)
+        new_len *= 2;
+
+    if (ftruncate(cap->fd, new_len) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to grow capture file\n");
+        return -1;
+    }
+
+    munmap(cap->map, cap->map_len);
+    cap->map = NULL;
+
+    return capture_mmap(cap, new_len);
+}
+
+/*
+ * Creates a capture file at path, replacing any existing file
+ */
+mqtt_capture *mqtt_capture_open(const char *path) {
+    mqtt_capture *cap;
+    capture_hdr *hdr;
+
+    if ((cap = (mqtt_capture *)mqtt_malloc(sizeof(mqtt_capture))) == NULL) {
+        return NULL;
+    }
+    memset(cap, 0, sizeof(mqtt_capture));
+    cap->writable = true;
+
+    if ((cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to create capture file %s\n", path);
+        mqtt_free(cap);
+        return NULL;
+    }
+
+    if (ftruncate(cap->fd, CAPTURE_MAP_LEN) < 0 ||
+        capture_mmap(cap, CAPTURE_MAP_LEN) < 0) {
+        close(cap->fd);
+        mqtt_free(cap);
+        return NULL;
+    }
+
+    hdr = (capture_hdr *)cap->map;
+    hdr->magic = CAPTURE_MAGIC;
+    hdr->version = CAPTURE_VERSION;
+    hdr->start_ns = clock_ns(CLOCK_REALTIME);
+    hdr->used = sizeof(capture_hdr);
+    cap->start = clock_ns(CLOCK_MONOTONIC);
+
+    return cap;
+}
+
+/*
+ * Maps an existing capture file for reading
+ */
+mqtt_capture *mqtt_capture_map(const char *path) {
+    mqtt_capture *cap;
+    capture_hdr *hdr;
+    struct stat st;
+
+    if ((cap = (mqtt_capture *)mqtt_malloc(sizeof(mqtt_capture))) == NULL) {
+        return NULL;
+    }
+    memset(cap, 0, sizeof(mqtt_capture));
+
+    if ((cap->fd = open(path, O_RDONLY)) < 0 || fstat(cap->fd, &st) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to open capture file %s\n", path);
+        goto fail;
+    }
+
+    if ((size_t)st.st_size < sizeof(capture_hdr)) {
+        if (VERBOSE)
+            fprintf(stderr, "Invalid capture file %s\n", path);
+        goto fail;
+    }
+    else if (capture_mmap(cap, st.st_size) < 0) {
+        goto fail;
+    }
+
+    hdr = (capture_hdr *)cap->map;
+    if (hdr->magic != CAPTURE_MAGIC || hdr->version != CAPTURE_VERSION ||
+        hdr->used < sizeof(capture_hdr) || hdr->used > cap->map_len) {
+        if (VERBOSE)
+            fprintf(stderr, "Invalid capture file %s\n", path);
+        goto fail;
+    }
+
+    return cap;
+
+fail:
+    mqtt_capture_close(cap);
+    return NULL;
+}
+
+/*
+ * Unmaps a capture file, files being written are cut to the bytes in use
+ */
+void mqtt_capture_close(mqtt_capture *cap) {
+    if (cap == NULL) {
+        return;
+    }
+
+    if (cap->map != NULL) {
+        uint64_t used = ((capture_hdr *)cap->map)->used;
+        munmap(cap->map, cap->map_len);
+        if (cap->writable && ftruncate(cap->fd, used) < 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to truncate capture file\n");
+        }
+    }
+    if (cap->fd >= 0)
+        close(cap->fd);
+    mqtt_free(cap);
+}
+
+/*
+ * Appends a packet to the capture
+ */
+static capture_rec *rec_reserve(mqtt_capture *cap, capture_dir_t dir,
+                                size_t len) {
+    capture_hdr *hdr = (capture_hdr *)cap->map;
+    capture_rec *rec;
+    size_t size = rec_size(len);
+
+    if (hdr == NULL || len > UINT32_MAX) {
+        return NULL; // lost the mapping growing the file
+    }
+
+    if (hdr->used + size > cap->map_len) {
+        if (capture_grow(cap, hdr->used + size) < 0) {
+            return NULL;
+        }
+        hdr = (capture_hdr *)cap->map;
+    }
+
+    rec = (capture_rec *)&cap->map[hdr->used];
+    rec->ts_ns = clock_ns(CLOCK_MONOTONIC) - cap->start;
+    rec->len = len;
+    rec->dir = dir;
+
+    return rec;
+}
+
+/* The record is only part of the capture once its packet is filled in */
+static void rec_commit(mqtt_capture *cap, capture_rec *rec) {
+    ((capture_hdr *)cap->map)->used += rec_size(rec->len);
+}
+
+int mqtt_capture_write(mqtt_capture *cap, capture_dir_t dir,
+                       const char *pkt, size_t len) {
+    capture_rec *rec;
+
+    if ((rec = rec_reserve(cap, dir, len)) == NULL) {
+        return -1;
+    }
+
+    memcpy(rec + 1, pkt, len);
+    rec_commit(cap, rec);
+
+    return 0;
+}
+
+/*
+ * Records a packet whose payload is len bytes of fd from offset, read
+ * straight into the mapped file
+ */
+int mqtt_capture_write_fd(mqtt_capture *cap, capture_dir_t dir,
+                          const char *header, size_t header_len,
+                          int fd, off_t offset, size_t len) {
+    capture_rec *rec;
+    char *payload;
+
+    if ((rec = rec_reserve(cap, dir, header_len + len)) == NULL) {
+        return -1;
+    }
+
+    memcpy(rec + 1, header, header_len);
+    payload = (char *)(rec + 1) + header_len;
+    while (len > 0) {
+        ssize_t read_len = pread(fd, payload, len, offset);
+
+        if (read_len <= 0) {
+            if (read_len < 0 && errno == EINTR)
+                continue;
+            if (VERBOSE)
+                fprintf(stderr, "Unable to capture payload\n");
+            return -1;
+        }
+        payload += read_len;
+        offset += read_len;
+        len -= read_len;
+    }
+    rec_commit(cap, rec);
+
+    return 0;
+}
+
+/*
+ * Returns the record at *off and moves *off past it, NULL at the end.
+ * Start with *off at 0.
+ */
+const capture_rec *mqtt_capture_next(mqtt_capture *cap, size_t *off) {
+    capture_hdr *hdr = (capture_hdr *)cap->map;
+    const capture_rec *rec;
+
+    if (*off < sizeof(capture_hdr)) {
+        *off = sizeof(capture_hdr);
+    }
+
+    if (*off + sizeof(capture_rec) > hdr->used) {
+        return NULL;
+    }
+    rec = (const capture_rec *)&cap->map[*off];
+    if (*off + rec_size(rec->len) > hdr->used) {
+        return NULL; // truncated record
+    }
+    *off += rec_size(rec->len);
+
+    return rec;
+}
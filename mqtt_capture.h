@@ -0,0 +1,59 @@
+#ifndef MQTT_CAPTURE_H
+#define MQTT_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+
+/*
+ * Packet capture of a broker connection.
+ * Memory-mapped file of a header followed by records, each holding one
+ * packet as sent or received on the wire. Records are padded to 8 bytes.
+ */
+
+#define CAPTURE_MAGIC   0x5443514d      // "MQCT"
+#define CAPTURE_VERSION 1
+
+/* Direction of a captured packet */
+typedef enum { CAPTURE_IN, CAPTURE_OUT } capture_dir_t;
+
+/* File header */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_ns;          // wall clock time capture started
+    uint64_t used;              // bytes of the file in use, header included
+} capture_hdr;
+
+/* Record header, followed by len packet bytes */
+typedef struct {
+    uint64_t ts_ns;             // time since capture started
+    uint32_t len;
+    uint8_t dir;
+    uint8_t pad[3];
+} capture_rec;
+
+struct mqtt_capture {
+    int fd;
+    char *map;
+    size_t map_len;
+    uint64_t start;             // monotonic time capture started
+    bool writable;
+};
+
+typedef struct mqtt_capture mqtt_capture;
+
+mqtt_capture *mqtt_capture_open(const char *path);
+mqtt_capture *mqtt_capture_map(const char *path);
+void mqtt_capture_close(mqtt_capture *cap);
+
+int mqtt_capture_write(mqtt_capture *cap, capture_dir_t dir,
+                       const char *pkt, size_t len);
+int mqtt_capture_write_fd(mqtt_capture *cap, capture_dir_t dir,
+                          const char *header, size_t header_len,
+                          int fd, off_t offset, size_t len);
+const capture_rec *mqtt_capture_next(mqtt_capture *cap, size_t *off);
+
+#endif // MQTT_CAPTURE_H
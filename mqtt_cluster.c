@@ -0,0 +1,542 @@
+/*
+ * Multi-broker failover for the MQTT publish and subscribe client.
+ * Written by Edward Lu
+ */
+
+#include "mqtt_cluster.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include <string.h>
+
+#define VERBOSE 1
+
+#define PROBE_ID_LEN    4           // "_p" + endpoint index in probe ids
+#define RTT_WEIGHT      4           // EWMA, a new sample weighs 1/4
+#define SLOW_FACTOR     2           // active is slow at twice the best rtt
+#define SLOW_MIN_NS     1000000     // and at least 1 ms more
+#define SLOW_ROUNDS     3           // for this many of its probes in a row
+#define STALL_PROBES    2           // a probe this many intervals late fails
+#define MAX_BACKOFF     3           // failed endpoints are probed up to 8x
+                                    // less often
+
+/* Small helper functions */
+static uint64_t now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Disconnects and frees a broker, mqtt_disconnect frees it itself when the
+ * DISCONNECT can't be sent
+ */
+static void broker_close(mqtt_broker *broker) {
+    if (mqtt_disconnect(broker) >= 0)
+        free_broker(broker);
+}
+
+static void probe_on_ack(mqtt_broker *broker, control_packet_t type,
+                         uint16_t packet_id, int status, void *arg) {
+    if (type == PINGRESP)
+        *(bool *)arg = true;
+}
+
+/*
+ * Pings a probe through the async API. mqtt_ping frees the broker when the
+ * PINGREQ can't be sent, the probe couldn't tell if it still owns it.
+ */
+static bool probe_ping(mqtt_broker *probe, int timeout_ms) {
+    uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000, now;
+    bool pong = false;
+
+    if (mqtt_set_callbacks(probe, NULL, probe_on_ack, &pong) < 0 ||
+        mqtt_ping_async(probe) < 0) {
+        return false;
+    }
+
+    while (!pong && (now = now_ns()) < deadline &&
+           mqtt_poll(probe, (deadline - now) / 1000000 + 1) >= 0)
+        ;
+    mqtt_set_callbacks(probe, NULL, NULL, NULL);
+
+    return pong;
+}
+
+/*
+ * Checks if an endpoint can take the connection, lock held. A probe hanging
+ * on a broker that stopped answering counts as a failure.
+ */
+static bool endpoint_usable(mqtt_cluster *cluster, int idx, uint64_t now) {
+    cluster_endpoint *ep = &cluster->endpoints[idx];
+    uint64_t stall_ns = (uint64_t)cluster->probe_ms * STALL_PROBES * 1000000;
+
+    return ep->healthy && (ep->busy_since == 0 ||
+                           now - ep->busy_since < stall_ns);
+}
+
+/*
+ * Usable endpoint with the lowest round trip time other than exclude, -1 if
+ * there is none. Lock held.
+ */
+static int best_endpoint(mqtt_cluster *cluster, int exclude, uint64_t now) {
+    int best = -1;
+
+    for (int i = 0; i < cluster->num_endpoints; i++) {
+        if (i == exclude || !endpoint_usable(cluster, i, now))
+            continue;
+        if (best < 0 ||
+            cluster->endpoints[i].rtt_ns < cluster->endpoints[best].rtt_ns)
+            best = i;
+    }
+
+    return best;
+}
+
+/*
+ * Connects the probe of an endpoint, or pings it if it is connected, and
+ * updates the endpoint's statistics with the time it took
+ */
+static void probe_endpoint(mqtt_cluster *cluster, int idx) {
+    cluster_endpoint *ep = &cluster->endpoints[idx];
+    // sized for any id and index, create keeps the result a valid client id
+    char client_id[CLIENTID_LEN + PROBE_ID_LEN];
+    uint64_t start = now_ns(), sample;
+    bool connect = (ep->probe == NULL), ok;
+
+    pthread_mutex_lock(&cluster->lock);
+    ep->busy_since = start;
+    pthread_mutex_unlock(&cluster->lock);
+
+    if (connect) {
+        snprintf(client_id, sizeof(client_id), "%s_p%u",
+                 cluster->client_id, (unsigned)idx % CLUSTER_MAX_ENDPOINTS);
+        // a probe this late counts as failed, and destroy waits for it
+        ep->probe = mqtt_init_timeout(ep->hostname, client_id, ep->port,
+                                      cluster->probe_ms * STALL_PROBES);
+        // mqtt_connect frees the broker when it fails
+        if (ep->probe != NULL &&
+            mqtt_connect(ep->probe, CLEAN_SESSION, cluster->keep_alive) < 0)
+            ep->probe = NULL;
+        ok = ep->probe != NULL;
+    }
+    else {
+        ok = probe_ping(ep->probe, cluster->probe_ms * STALL_PROBES);
+    }
+    sample = now_ns() - start;
+
+    if (!ok && ep->probe != NULL) {
+        free_broker(ep->probe);
+        ep->probe = NULL;
+    }
+
+    pthread_mutex_lock(&cluster->lock);
+    ep->busy_since = 0;
+    if (ok) {
+        if (connect) {
+            // TCP handshake plus CONNECT/CONNACK, two round trips
+            ep->connect_ns = sample;
+            sample /= 2;
+        }
+        if (ep->rtt_ns == 0 || !ep->healthy)
+            ep->rtt_ns = sample;
+        else
+            ep->rtt_ns += ((int64_t)sample - (int64_t)ep->rtt_ns) /
+                          RTT_WEIGHT;
+        ep->healthy = true;
+        ep->failures = 0;
+    }
+    else {
+        ep->healthy = false;
+        ep->failures++;
+    }
+
+    // count the probes in a row the active endpoint was much slower
+    if (idx == cluster->active) {
+        int best = best_endpoint(cluster, idx, now_ns());
+        uint64_t best_rtt = (best >= 0) ? cluster->endpoints[best].rtt_ns : 0;
+
+        if (best >= 0 && ep->rtt_ns > best_rtt * SLOW_FACTOR &&
+            ep->rtt_ns - best_rtt > SLOW_MIN_NS)
+            cluster->slow_rounds++;
+        else
+            cluster->slow_rounds = 0;
+    }
+
+    ep->probes++;
+    pthread_cond_broadcast(&cluster->wake);
+    pthread_mutex_unlock(&cluster->lock);
+}
+
+/*
+ * Monitor thread of one endpoint, probes until the cluster is destroyed
+ */
+static void *monitor_run(void *arg) {
+    cluster_endpoint *ep = (cluster_endpoint *)arg;
+    mqtt_cluster *cluster = ep->cluster;
+    int idx = ep - cluster->endpoints;
+    struct timespec deadline;
+    uint64_t interval_ns;
+
+    pthread_mutex_lock(&cluster->lock);
+    while (cluster->running) {
+        pthread_mutex_unlock(&cluster->lock);
+        probe_endpoint(cluster, idx);
+        pthread_mutex_lock(&cluster->lock);
+
+        // back off from endpoints that keep failing
+        interval_ns = (uint64_t)cluster->probe_ms * 1000000 <<
+                      (ep->failures < MAX_BACKOFF ? ep->failures
+                                                  : MAX_BACKOFF);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval_ns / 1000000000;
+        deadline.tv_nsec += interval_ns % 1000000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (cluster->running &&
+               pthread_cond_timedwait(&cluster->wake, &cluster->lock,
+                                      &deadline) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&cluster->lock);
+
+    if (ep->probe != NULL) {
+        broker_close(ep->probe);
+        ep->probe = NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Connects to an endpoint and subscribes to the cluster's topics
+ */
+static mqtt_broker *connect_endpoint(mqtt_cluster *cluster, int idx) {
+    cluster_endpoint *ep = &cluster->endpoints[idx];
+    mqtt_broker *broker;
+
+    if ((broker = mqtt_init(ep->hostname, cluster->client_id,
+                            ep->port)) == NULL) {
+        return NULL;
+    }
+
+    // mqtt_connect frees the broker when it fails
+    if (mqtt_connect(broker, cluster->connect_flags,
+                     cluster->keep_alive) < 0) {
+        return NULL;
+    }
+
+    for (int i = 0; i < cluster->num_subs; i++) {
+        if (mqtt_sub(broker, cluster->subs[i].topic,
+                     cluster->subs[i].qos) < 0) {
+            broker_close(broker);
+            return NULL;
+        }
+    }
+
+    return broker;
+}
+
+/*
+ * Moves the connection to the best usable endpoint. The current endpoint is
+ * only tried again, last, when its connection is broken. Returns 1 if the
+ * connection moved, 0 if it stayed and -1 if no endpoint could be reached.
+ */
+static int cluster_failover(mqtt_cluster *cluster, bool broken) {
+    int order[CLUSTER_MAX_ENDPOINTS], num = 0, cur = cluster->active;
+    uint64_t rtt[CLUSTER_MAX_ENDPOINTS], now = now_ns();
+    mqtt_broker *broker = NULL;
+
+    // candidates by round trip time
+    pthread_mutex_lock(&cluster->lock);
+    for (int i = 0, j; i < cluster->num_endpoints; i++) {
+        if (i == cur || !endpoint_usable(cluster, i, now))
+            continue;
+        for (j = num++; j > 0 && rtt[j - 1] > cluster->endpoints[i].rtt_ns;
+             j--) {
+            order[j] = order[j - 1];
+            rtt[j] = rtt[j - 1];
+        }
+        order[j] = i;
+        rtt[j] = cluster->endpoints[i].rtt_ns;
+    }
+    pthread_mutex_unlock(&cluster->lock);
+
+    if (broken && cur >= 0)
+        order[num++] = cur;
+
+    for (int i = 0; i < num && broker == NULL; i++) {
+        if ((broker = connect_endpoint(cluster, order[i])) != NULL) {
+            if (cluster->broker != NULL) {
+                if (!broken)
+                    broker_close(cluster->broker);
+                else
+                    free_broker(cluster->broker);
+            }
+            cluster->broker = broker;
+
+            pthread_mutex_lock(&cluster->lock);
+            cluster->active = order[i];
+            cluster->slow_rounds = 0;
+            pthread_mutex_unlock(&cluster->lock);
+
+            return 1;
+        }
+    }
+
+    if (!broken) {
+        return 0;
+    }
+
+    if (cluster->broker != NULL) {
+        free_broker(cluster->broker);
+        cluster->broker = NULL;
+    }
+    pthread_mutex_lock(&cluster->lock);
+    cluster->active = -1;
+    pthread_mutex_unlock(&cluster->lock);
+
+    if (VERBOSE)
+        fprintf(stderr, "No broker of the cluster reachable\n");
+    return -1;
+}
+
+/*
+ * Creates an empty cluster, endpoints are probed every probe_ms once
+ * connected. client_id is used for the connection, the probes append "_p"
+ * and the endpoint index to it.
+ */
+mqtt_cluster *mqtt_cluster_create(const char *client_id,
+                                  uint8_t connect_flags, uint8_t keep_alive,
+                                  int probe_ms) {
+    mqtt_cluster *cluster;
+
+    if (client_id == NULL || strlen(client_id) == 0 ||
+        strlen(client_id) >= CLIENTID_LEN - PROBE_ID_LEN) {
+        if (VERBOSE)
+            fprintf(stderr, "Invalid cluster client id\n");
+        return NULL;
+    }
+    else if (probe_ms <= 0) {
+        return NULL;
+    }
+
+    if ((cluster = (mqtt_cluster *)mqtt_malloc(sizeof(mqtt_cluster))) ==
+        NULL) {
+        return NULL;
+    }
+
+    memset(cluster, 0, sizeof(mqtt_cluster));
+    strcpy(cluster->client_id, client_id);
+    cluster->connect_flags = connect_flags;
+    cluster->keep_alive = keep_alive;
+    cluster->probe_ms = probe_ms;
+    cluster->active = -1;
+    pthread_mutex_init(&cluster->lock, NULL);
+    pthread_cond_init(&cluster->wake, NULL);
+
+    return cluster;
+}
+
+/*
+ * Adds a broker endpoint, only before the cluster is connected
+ */
+int mqtt_cluster_add(mqtt_cluster *cluster, const char *hostname,
+                     uint16_t port) {
+    cluster_endpoint *ep;
+
+    if (cluster == NULL || hostname == NULL || cluster->running) {
+        return -1;
+    }
+    else if (strlen(hostname) >= HOSTNAME_LEN) { // same limit as mqtt_init
+        if (VERBOSE)
+            fprintf(stderr, "Invalid hostname\n");
+        return -1;
+    }
+    else if (cluster->num_endpoints == CLUSTER_MAX_ENDPOINTS) {
+        if (VERBOSE)
+            fprintf(stderr, "Too many cluster endpoints\n");
+        return -1;
+    }
+
+    ep = &cluster->endpoints[cluster->num_endpoints++];
+    strcpy(ep->hostname, hostname);
+    ep->port = port;
+    ep->cluster = cluster;
+
+    return 0;
+}
+
+/*
+ * Starts probing the endpoints and connects to the best one once they all
+ * answered or failed, or the probes took too long
+ */
+int mqtt_cluster_connect(mqtt_cluster *cluster) {
+    struct timespec deadline;
+    int probed = 0;
+
+    if (cluster == NULL || cluster->running || cluster->num_endpoints == 0) {
+        return -1;
+    }
+
+    cluster->running = true;
+    for (int i = 0; i < cluster->num_endpoints; i++) {
+        if (pthread_create(&cluster->endpoints[i].monitor, NULL, monitor_run,
+                           &cluster->endpoints[i]) != 0) {
+            if (VERBOSE)
+                fprintf(stderr, "Unable to start cluster monitor\n");
+            return -1;
+        }
+        cluster->num_monitors++;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (cluster->probe_ms * STALL_PROBES) / 1000 + 1;
+
+    pthread_mutex_lock(&cluster->lock);
+    while (probed < cluster->num_endpoints) {
+        probed = 0;
+        for (int i = 0; i < cluster->num_endpoints; i++)
+            probed += cluster->endpoints[i].probes > 0;
+        if (probed < cluster->num_endpoints &&
+            pthread_cond_timedwait(&cluster->wake, &cluster->lock,
+                                   &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&cluster->lock);
+
+    return (cluster_failover(cluster, true) > 0) ? 0 : -1;
+}
+
+/*
+ * Connection to the active endpoint, NULL if none is reachable. It changes
+ * when mqtt_cluster_check returns 1.
+ */
+mqtt_broker *mqtt_cluster_broker(mqtt_cluster *cluster) {
+    return (cluster != NULL) ? cluster->broker : NULL;
+}
+
+/*
+ * Subscribes on the active connection and again after every failover
+ */
+int mqtt_cluster_sub(mqtt_cluster *cluster, const char *topic,
+                     mqtt_qos_t qos) {
+    cluster_sub *subs;
+    int i;
+
+    if (cluster == NULL || topic == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < cluster->num_subs; i++) {
+        if (strcmp(cluster->subs[i].topic, topic) == 0)
+            break;
+    }
+
+    if (i == cluster->num_subs) {
+        subs = (cluster_sub *)mqtt_realloc(cluster->subs,
+                                           (i + 1) * sizeof(cluster_sub));
+        if (subs == NULL) {
+            return -1;
+        }
+        cluster->subs = subs;
+        if ((subs[i].topic = (char *)mqtt_malloc(strlen(topic) + 1)) == NULL) {
+            return -1;
+        }
+        strcpy(subs[i].topic, topic);
+        cluster->num_subs++;
+    }
+    cluster->subs[i].qos = qos;
+
+    // without a connection the subscription is made on the next connect
+    if (cluster->broker == NULL) {
+        return 0;
+    }
+    return mqtt_sub(cluster->broker, topic, qos);
+}
+
+int mqtt_cluster_unsub(mqtt_cluster *cluster, const char *topic) {
+    if (cluster == NULL || topic == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < cluster->num_subs; i++) {
+        if (strcmp(cluster->subs[i].topic, topic) == 0) {
+            mqtt_free(cluster->subs[i].topic);
+            cluster->subs[i] = cluster->subs[--cluster->num_subs];
+            break;
+        }
+    }
+
+    if (cluster->broker == NULL) {
+        return 0;
+    }
+    return mqtt_unsub(cluster->broker, topic);
+}
+
+/*
+ * Fails over if the active endpoint stopped answering its probes, has been
+ * much slower than another one for SLOW_ROUNDS probes, or failed is set
+ * because a call on the connection failed. Call it regularly from the thread
+ * using the connection. Returns 1 if the connection moved, callbacks and
+ * other settings of the broker then have to be set again. Returns 0 if it
+ * didn't and -1 if no endpoint is reachable.
+ */
+int mqtt_cluster_check(mqtt_cluster *cluster, bool failed) {
+    bool broken, slow;
+
+    if (cluster == NULL || !cluster->running) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cluster->lock);
+    broken = failed || cluster->active < 0 ||
+             !endpoint_usable(cluster, cluster->active, now_ns());
+    slow = cluster->slow_rounds >= SLOW_ROUNDS;
+    pthread_mutex_unlock(&cluster->lock);
+
+    if (!broken && !slow) {
+        return 0;
+    }
+    return cluster_failover(cluster, broken);
+}
+
+/*
+ * Stops the monitor threads and disconnects
+ */
+int mqtt_cluster_destroy(mqtt_cluster *cluster) {
+    if (cluster == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cluster->lock);
+    cluster->running = false;
+    pthread_cond_broadcast(&cluster->wake);
+    pthread_mutex_unlock(&cluster->lock);
+
+    // a monitor stuck on an unresponsive broker returns when its connect or
+    // receive times out, after STALL_PROBES probe intervals
+    for (int i = 0; i < cluster->num_monitors; i++)
+        pthread_join(cluster->endpoints[i].monitor, NULL);
+
+    if (cluster->broker != NULL) {
+        broker_close(cluster->broker);
+    }
+
+    for (int i = 0; i < cluster->num_subs; i++)
+        mqtt_free(cluster->subs[i].topic);
+    mqtt_free(cluster->subs);
+
+    pthread_cond_destroy(&cluster->wake);
+    pthread_mutex_destroy(&cluster->lock);
+    mqtt_free(cluster);
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef MQTT_CLUSTER_H
+#define MQTT_CLUSTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "mqtt.h"
+
+/*
+ * Multi-broker failover.
+ * A cluster is a list of endpoints serving the same topics. A monitor thread
+ * keeps a probe connection to every endpoint, timing the connect and then a
+ * PINGREQ/PINGRESP round trip every probe interval. The client connects to
+ * the healthy endpoint with the lowest round trip time and moves to the next
+ * best one when its endpoint fails or stays much slower than another.
+ * The application owns the active connection, so the switch itself happens
+ * in mqtt_cluster_check, called from the thread using the broker.
+ */
+
+#define CLUSTER_MAX_ENDPOINTS   16
+
+struct mqtt_cluster;
+
+/* Endpoint and its probe statistics, updated by its monitor thread */
+typedef struct {
+    char hostname[HOSTNAME_LEN + 1];
+    uint16_t port;
+    struct mqtt_cluster *cluster;
+    pthread_t monitor;
+    mqtt_broker *probe;         // owned by the monitor thread
+    bool healthy;
+    uint64_t rtt_ns;            // EWMA of the probe round trips
+    uint64_t connect_ns;        // last probe connect time
+    uint64_t busy_since;        // start of the probe in flight, 0 if idle
+    int failures;               // consecutive failed probes
+    int probes;
+} cluster_endpoint;
+
+/* Topic to subscribe again after a failover */
+typedef struct {
+    char *topic;
+    mqtt_qos_t qos;
+} cluster_sub;
+
+typedef struct mqtt_cluster {
+    char client_id[CLIENTID_LEN];
+    uint8_t connect_flags;
+    uint8_t keep_alive;
+    int probe_ms;
+
+    cluster_endpoint endpoints[CLUSTER_MAX_ENDPOINTS];
+    int num_endpoints;
+    int active;                 // endpoint of broker, -1 if disconnected
+    int slow_rounds;            // consecutive probe rounds active was slow
+    mqtt_broker *broker;
+
+    cluster_sub *subs;
+    int num_subs;
+
+    int num_monitors;
+    bool running;
+    pthread_mutex_t lock;       // endpoint stats, active and slow_rounds
+    pthread_cond_t wake;
+} mqtt_cluster;
+
+mqtt_cluster *mqtt_cluster_create(const char *client_id,
+                                  uint8_t connect_flags, uint8_t keep_alive,
+                                  int probe_ms);
+int mqtt_cluster_add(mqtt_cluster *cluster, const char *hostname,
+                     uint16_t port);
+int mqtt_cluster_connect(mqtt_cluster *cluster);
+mqtt_broker *mqtt_cluster_broker(mqtt_cluster *cluster);
+int mqtt_cluster_sub(mqtt_cluster *cluster, const char *topic,
+                     mqtt_qos_t qos);
+int mqtt_cluster_unsub(mqtt_cluster *cluster, const char *topic);
+int mqtt_cluster_check(mqtt_cluster *cluster, bool failed);
+int mqtt_cluster_destroy(mqtt_cluster *cluster);
+
+#endif // MQTT_CLUSTER_H
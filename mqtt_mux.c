@@ -0,0 +1,1066 @@
+/*
+ * Shared memory multiplexer for the MQTT publish and subscribe client.
+ * Written by Edward Lu
+ */
+
+#include "mqtt_mux.h"
+#include "mqtt_cache.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define VERBOSE 1
+
+#define MUX_MAGIC       0x4d515458  // "MQTX"
+#define MUX_RING_MASK   (MUX_RING_SLOTS - 1)
+#define MUX_TIMEOUT_US  30000000    // same as the broker recv timeout (30 sec)
+#define MUX_SLEEP_NS    50000       // 50 usec between ring polls without
+                                    // futexes
+
+/*
+ * Ring buffer helpers
+ */
+static int ring_push(mux_ring_t *ring, const mux_msg_t *msg) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (tail - head == MUX_RING_SLOTS) {
+        return -1; // full
+    }
+
+    memcpy(&ring->slots[tail & MUX_RING_MASK], msg, sizeof(mux_msg_t));
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    return 0;
+}
+
+static int ring_peek(mux_ring_t *ring, mux_msg_t *msg) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head == tail) {
+        return -1; // empty
+    }
+
+    memcpy(msg, &ring->slots[head & MUX_RING_MASK], sizeof(mux_msg_t));
+
+    return 0;
+}
+
+static void ring_drop(mux_ring_t *ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static int ring_pop(mux_ring_t *ring, mux_msg_t *msg) {
+    if (ring_peek(ring, msg) < 0) {
+        return -1;
+    }
+
+    ring_drop(ring);
+
+    return 0;
+}
+
+static void ring_reset(mux_ring_t *ring) {
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+}
+
+/*
+ * Path of the FIFO clients write to wake a blocked owner. The owner can poll
+ * it together with the broker socket.
+ */
+static void wake_path(char *path, const char *name) {
+    snprintf(path, MUX_WAKE_LEN, "/tmp/mqtt_mux.%s", name + 1);
+}
+
+/*
+ * Blocks while *word is val, at most timeout_us. The segment is shared
+ * between processes, so these are not private futexes.
+ */
+static void futex_wait(_Atomic uint32_t *word, uint32_t val,
+                       uint64_t timeout_us) {
+#ifdef __linux__
+    struct timespec ts = { timeout_us / 1000000,
+                           (timeout_us % 1000000) * 1000 };
+
+    syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+    struct timespec ts = { 0, MUX_SLEEP_NS };
+
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static void futex_wake(_Atomic uint32_t *word) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static uint64_t mono_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Wakes the client of slot if it is blocked in mqtt_mux_get_data
+ */
+static void client_wake(mux_slot_t *slot) {
+    // pairs with the fence in mqtt_mux_get_data
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&slot->waiting, memory_order_relaxed))
+        futex_wake(&slot->to_client.tail);
+}
+
+/*
+ * Fills a ring buffer slot, strings that do not fit are rejected
+ */
+static int msg_fill(mux_msg_t *msg, mux_op_t op, const char *topic,
+                    const char *payload, bool retain, bool dup,
+                    mqtt_qos_t qos) {
+    size_t topic_len = strlen(topic);
+    size_t payload_len = (payload != NULL) ? strlen(payload) : 0;
+
+    // leave room for the null terminator
+    if (topic_len >= MAXPACKET_LEN || payload_len >= MAXPACKET_LEN) {
+        if (VERBOSE)
+            fprintf(stderr, "Topic or message too long for multiplexer\n");
+        return -1;
+    }
+
+    msg->op = op;
+    msg->seq = 0;
+    msg->qos = qos;
+    msg->retain = retain;
+    msg->dup = dup;
+    msg->topic_len = topic_len;
+    msg->payload_len = payload_len;
+    memcpy(msg->topic, topic, topic_len + 1);
+    if (payload != NULL)
+        memcpy(msg->payload, payload, payload_len + 1);
+    else
+        msg->payload[0] = '\0';
+
+    return 0;
+}
+
+/*
+ * Owner side
+ */
+
+/*
+ * Highest QoS a local client other than skip holds filter with, -1 if no
+ * other client holds it
+ */
+static int filter_qos(mqtt_mux *mux, int skip, const char *filter) {
+    int qos = -1;
+
+    for (int i = 0; i < MUX_MAX_CLIENTS; i++) {
+        mux_client_subs *subs = &mux->clients[i];
+        if (i == skip)
+            continue;
+        for (int j = 0; j < subs->num_subs; j++) {
+            if ((int)subs->sub_qos[j] > qos &&
+                strcmp(subs->subs[j], filter) == 0)
+                qos = subs->sub_qos[j];
+        }
+    }
+    return qos;
+}
+
+/*
+ * Fills a delivery of data for a subscription of the given QoS
+ */
+static void msg_from_data(mux_msg_t *msg, const mqtt_data_t *data,
+                          mqtt_qos_t sub_qos) {
+    int topic_len = data->topic_len, payload_len = data->payload_len;
+
+    if (topic_len >= MAXPACKET_LEN)
+        topic_len = MAXPACKET_LEN - 1;
+    if (payload_len >= MAXPACKET_LEN)
+        payload_len = MAXPACKET_LEN - 1;
+
+    msg->op = MUX_DATA;
+    msg->qos = (data->qos < sub_qos) ? data->qos : sub_qos;
+    msg->retain = data->retain;
+    msg->dup = false;
+    msg->topic_len = topic_len;
+    msg->payload_len = payload_len;
+    memcpy(msg->topic, data->topic, topic_len);
+    msg->topic[topic_len] = '\0';
+    memcpy(msg->payload, data->payload, payload_len);
+    msg->payload[payload_len] = '\0';
+}
+
+/*
+ * Counts a delivery a client lost, it never stalls the other clients
+ */
+static void count_drop(mqtt_mux *mux, int idx) {
+    // reported once until the client reads the count
+    if (atomic_fetch_add_explicit(&mux->shm->slots[idx].dropped, 1,
+                                  memory_order_relaxed) == 0 && VERBOSE)
+        fprintf(stderr, "Multiplexer client %d ring full\n", idx);
+}
+
+/*
+ * Moves held deliveries into the client ring as it makes room
+ */
+static void backlog_flush(mqtt_mux *mux, int idx) {
+    mux_slot_t *slot = &mux->shm->slots[idx];
+    mux_backlog *backlog = &mux->backlogs[idx];
+    int pushed = 0;
+
+    while (backlog->len > 0 &&
+           ring_push(&slot->to_client, &backlog->msgs[backlog->head]) == 0) {
+        backlog->head = (backlog->head + 1) % MUX_BACKLOG_LEN;
+        backlog->len--;
+        pushed++;
+    }
+
+    if (pushed > 0)
+        client_wake(slot);
+    if (backlog->len == 0 && backlog->msgs != NULL) {
+        mqtt_free(backlog->msgs);
+        backlog->msgs = NULL;
+        backlog->head = 0;
+        atomic_store_explicit(&slot->backlogged, 0, memory_order_relaxed);
+    }
+}
+
+/*
+ * Delivers a message to one client. The owner already acknowledged QoS 1
+ * and 2 messages to the broker, so when the ring is full they are held
+ * until the client makes room. QoS 0 messages are dropped, like a broker
+ * does to a slow subscriber.
+ */
+static void client_push(mqtt_mux *mux, int idx, const mux_msg_t *msg) {
+    mux_slot_t *slot = &mux->shm->slots[idx];
+    mux_backlog *backlog = &mux->backlogs[idx];
+
+    // behind held deliveries, so the client gets them in order
+    if (backlog->len == 0) {
+        if (ring_push(&slot->to_client, msg) == 0) {
+            client_wake(slot);
+            return;
+        }
+        if (msg->qos == QOS0) {
+            count_drop(mux, idx);
+            return;
+        }
+    }
+
+    if (backlog->len == MUX_BACKLOG_LEN ||
+        (backlog->msgs == NULL &&
+         (backlog->msgs = (mux_msg_t *)mqtt_malloc(MUX_BACKLOG_LEN *
+                                                   sizeof(mux_msg_t)))
+         == NULL)) {
+        count_drop(mux, idx);
+        return;
+    }
+
+    memcpy(&backlog->msgs[(backlog->head + backlog->len) % MUX_BACKLOG_LEN],
+           msg, sizeof(mux_msg_t));
+    backlog->len++;
+    atomic_store_explicit(&slot->backlogged, 1, memory_order_relaxed);
+}
+
+/*
+ * Hands a client the retained value of filter from the owner's cache, so a
+ * filter other clients hold needs no SUBSCRIBE. Returns false if the cache
+ * can't tell what the broker would resend.
+ */
+static bool replay_cached(mqtt_mux *mux, int idx, const char *filter,
+                          mqtt_qos_t qos) {
+    mqtt_cache *cache = mux->broker->cache;
+    mqtt_data_t data;
+    mux_msg_t msg;
+
+    if (cache == NULL || !mqtt_cache_complete(cache, filter) ||
+        mqtt_cache_get(cache, filter, &data) < 0) {
+        return false;
+    }
+
+    msg_from_data(&msg, &data, qos);
+    client_push(mux, idx, &msg);
+
+    return true;
+}
+
+/*
+ * Subscribes a client to filter. Returns the packet id of the SUBSCRIBE to
+ * wait for, 0 if the subscription is complete or -1 on failure.
+ */
+static int client_sub(mqtt_mux *mux, int idx, const char *filter,
+                      mqtt_qos_t qos) {
+    mux_client_subs *subs = &mux->clients[idx];
+    int j, held, ret;
+
+    for (j = 0; j < subs->num_subs; j++) {
+        if (strcmp(subs->subs[j], filter) == 0) {
+            subs->sub_qos[j] = qos;
+            goto broker_sub;
+        }
+    }
+
+    if (subs->num_subs == MUX_MAX_SUBS) {
+        if (VERBOSE)
+            fprintf(stderr, "Too many multiplexer subscriptions\n");
+        return -1;
+    }
+    strcpy(subs->subs[subs->num_subs], filter);
+    subs->sub_qos[subs->num_subs] = qos;
+    subs->replay_ids[subs->num_subs] = 0;
+    subs->num_subs++;
+
+broker_sub:
+    // one broker subscription per filter is shared by all local clients,
+    // but only a SUBSCRIBE makes the broker resend the retained values
+    held = filter_qos(mux, idx, filter);
+    if (held >= (int)qos && replay_cached(mux, idx, filter, qos))
+        return 0;
+
+    // the broker subscription keeps the highest QoS any client asked for
+    if ((ret = mqtt_sub_async(mux->broker, filter,
+                              (held > (int)qos) ? held : qos)) <= 0) {
+        return -1;
+    }
+    subs->replay_ids[j] = ret;
+    mux->pending++;
+
+    return ret;
+}
+
+/*
+ * A SUBACK means the retained values of older SUBSCRIBEs to the same filter
+ * were all sent, later ones only go to the new subscriber
+ */
+static void replay_done(mqtt_mux *mux, uint16_t packet_id) {
+    const char *filter = NULL;
+
+    for (int i = 0; i < MUX_MAX_CLIENTS && filter == NULL; i++) {
+        mux_client_subs *subs = &mux->clients[i];
+        for (int j = 0; j < subs->num_subs; j++) {
+            if (subs->replay_ids[j] == packet_id) {
+                filter = subs->subs[j];
+                break;
+            }
+        }
+    }
+    if (filter == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < MUX_MAX_CLIENTS; i++) {
+        mux_client_subs *subs = &mux->clients[i];
+        for (int j = 0; j < subs->num_subs; j++) {
+            if (subs->replay_ids[j] != 0 &&
+                (int16_t)(packet_id - subs->replay_ids[j]) > 0 &&
+                strcmp(subs->subs[j], filter) == 0)
+                subs->replay_ids[j] = 0;
+        }
+    }
+}
+
+/*
+ * Unsubscribes a client from filter. Returns the packet id of the
+ * UNSUBSCRIBE to wait for, 0 if other clients still hold the filter or -1
+ * on failure.
+ */
+static int client_unsub(mqtt_mux *mux, int idx, const char *filter) {
+    mux_client_subs *subs = &mux->clients[idx];
+    int ret = 0;
+
+    for (int j = 0; j < subs->num_subs; j++) {
+        if (strcmp(subs->subs[j], filter) == 0) {
+            subs->num_subs--;
+            if (j != subs->num_subs) {
+                strcpy(subs->subs[j], subs->subs[subs->num_subs]);
+                subs->sub_qos[j] = subs->sub_qos[subs->num_subs];
+                subs->replay_ids[j] = subs->replay_ids[subs->num_subs];
+            }
+            if (filter_qos(mux, idx, filter) < 0 &&
+                (ret = mqtt_unsub_async(mux->broker, filter)) > 0)
+                mux->pending++;
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void client_drop(mqtt_mux *mux, int idx) {
+    mux_client_subs *subs = &mux->clients[idx];
+
+    while (subs->num_subs > 0) {
+        char filter[MAXPACKET_LEN];
+        strcpy(filter, subs->subs[subs->num_subs - 1]);
+        client_unsub(mux, idx, filter);
+    }
+}
+
+/*
+ * Answers request seq of a client blocked in client_call
+ */
+static void client_reply(mqtt_mux *mux, int idx, uint32_t seq, int status) {
+    mux_slot_t *slot = &mux->shm->slots[idx];
+
+    if (seq == 0) {
+        return;
+    }
+
+    slot->reply_status = status;
+    atomic_store_explicit(&slot->reply_seq, seq, memory_order_release);
+    futex_wake(&slot->reply_seq);
+}
+
+/*
+ * Answers request seq once the broker sent ack for packet_id
+ */
+static void reply_on_ack(mqtt_mux *mux, int idx, uint32_t seq,
+                         control_packet_t ack, uint16_t packet_id) {
+    mux_reply *reply = &mux->replies[idx];
+
+    if (seq != 0) {
+        reply->seq = seq;
+        reply->ack = ack;
+        reply->packet_id = packet_id;
+    }
+}
+
+/*
+ * Delivers a message received from the broker to every matching client.
+ * Retained values only go to the subscriptions whose SUBSCRIBE asked for
+ * them, the other clients already had them.
+ */
+static void fan_out(mqtt_mux *mux, const mqtt_data_t *data) {
+    mux_msg_t msg;
+
+    for (int i = 0; i < MUX_MAX_CLIENTS; i++) {
+        mux_slot_t *slot = &mux->shm->slots[i];
+        mux_client_subs *subs = &mux->clients[i];
+
+        if (atomic_load_explicit(&slot->state, memory_order_acquire) !=
+            MUX_ACTIVE)
+            continue;
+
+        for (int j = 0; j < subs->num_subs; j++) {
+            if ((!data->retain || subs->replay_ids[j] != 0) &&
+                mqtt_topic_matches(subs->subs[j], data->topic)) {
+                msg_from_data(&msg, data, subs->sub_qos[j]);
+                client_push(mux, i, &msg);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Returns true if any local client has queued a request, detached or made
+ * room for held deliveries
+ */
+static bool requests_queued(mqtt_mux *mux) {
+    for (int i = 0; i < MUX_MAX_CLIENTS; i++) {
+        mux_slot_t *slot = &mux->shm->slots[i];
+
+        if (atomic_load_explicit(&slot->state, memory_order_relaxed) ==
+            MUX_DETACHED ||
+            atomic_load_explicit(&slot->to_owner.head,
+                                 memory_order_relaxed) !=
+            atomic_load_explicit(&slot->to_owner.tail, memory_order_acquire))
+            return true;
+
+        // held deliveries fit into the ring again
+        if (mux->backlogs[i].len > 0 &&
+            atomic_load_explicit(&slot->to_client.tail,
+                                 memory_order_relaxed) -
+            atomic_load_explicit(&slot->to_client.head,
+                                 memory_order_relaxed) < MUX_RING_SLOTS)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Waits up to timeout_ms for the broker socket or a client request
+ */
+static int owner_wait(mqtt_mux *mux, int timeout_ms) {
+    struct pollfd pfds[2];
+    char drain[64];
+    int ret;
+
+    if (timeout_ms == 0) {
+        return 0;
+    }
+
+    // clients check owner_waiting after queueing, so a request queued after
+    // the check below always writes to the FIFO
+    atomic_store_explicit(&mux->shm->owner_waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (requests_queued(mux)) {
+        atomic_store_explicit(&mux->shm->owner_waiting, 0,
+                              memory_order_relaxed);
+        return 0;
+    }
+
+    pfds[0].fd = mux->broker->socket_fd;
+    pfds[0].events = POLLIN | (mqtt_want_write(mux->broker) ? POLLOUT : 0);
+    pfds[1].fd = mux->wake_fd;
+    pfds[1].events = POLLIN;
+    ret = poll(pfds, 2, timeout_ms);
+
+    atomic_store_explicit(&mux->shm->owner_waiting, 0, memory_order_relaxed);
+    while (read(mux->wake_fd, drain, sizeof(drain)) > 0)
+        ;
+
+    return (ret < 0 && errno != EINTR) ? -1 : 0;
+}
+
+/*
+ * Broker callbacks, called from mqtt_poll in mqtt_mux_run_once
+ */
+static void mux_on_msg(mqtt_broker *broker, const mqtt_data_t *data,
+                       void *arg) {
+    mqtt_mux *mux = (mqtt_mux *)arg;
+
+    fan_out(mux, data);
+    mux->delivered++;
+}
+
+static void mux_on_ack(mqtt_broker *broker, control_packet_t type,
+                       uint16_t packet_id, int status, void *arg) {
+    mqtt_mux *mux = (mqtt_mux *)arg;
+
+    if (type == SUBACK)
+        replay_done(mux, packet_id);
+    if (type != PINGRESP && mux->pending > 0)
+        mux->pending--;
+
+    // packet ids of publishes and subscribes are counted separately
+    for (int i = 0; i < MUX_MAX_CLIENTS; i++) {
+        mux_reply *reply = &mux->replies[i];
+
+        if (reply->seq != 0 && reply->ack == type &&
+            reply->packet_id == packet_id) {
+            client_reply(mux, i, reply->seq, (status == FAILURE) ? -1 : 0);
+            reply->seq = 0;
+            break;
+        }
+    }
+}
+
+/*
+ * Creates a shared memory segment and multiplexes broker through it.
+ * The broker is driven through the async API and its callbacks are taken
+ * until mqtt_mux_destroy.
+ */
+mqtt_mux *mqtt_mux_create(const char *name, mqtt_broker *broker) {
+    int fd;
+    mqtt_mux *mux;
+    char path[MUX_WAKE_LEN];
+
+    if (broker == NULL || !broker->connected) {
+        if (VERBOSE)
+            fprintf(stderr, "Broker not set up\n");
+        return NULL;
+    }
+    else if (name[0] != '/' || strlen(name) >= MUX_NAME_LEN) {
+        if (VERBOSE)
+            fprintf(stderr, "Invalid multiplexer name\n");
+        return NULL;
+    }
+
+    if ((mux = (mqtt_mux *)mqtt_malloc(sizeof(mqtt_mux))) == NULL) {
+        return NULL;
+    }
+    memset(mux, 0, sizeof(mqtt_mux));
+    mux->broker = broker;
+    strcpy(mux->name, name);
+
+    if ((fd = shm_open(name, O_CREAT | O_RDWR, 0600)) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to create shared memory\n");
+        mqtt_free(mux);
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(mux_shm_t)) < 0 ||
+        (mux->shm = mmap(NULL, sizeof(mux_shm_t), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to map shared memory\n");
+        close(fd);
+        shm_unlink(name);
+        mqtt_free(mux);
+        return NULL;
+    }
+    close(fd);
+
+    // a FIFO left over by an owner that died is replaced
+    wake_path(path, name);
+    unlink(path);
+    if (mkfifo(path, 0600) < 0 ||
+        (mux->wake_fd = open(path, O_RDWR | O_NONBLOCK)) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to create wakeup FIFO\n");
+        munmap(mux->shm, sizeof(mux_shm_t));
+        shm_unlink(name);
+        mqtt_free(mux);
+        return NULL;
+    }
+
+    if (mqtt_set_callbacks(broker, mux_on_msg, mux_on_ack, mux) < 0) {
+        close(mux->wake_fd);
+        unlink(path);
+        munmap(mux->shm, sizeof(mux_shm_t));
+        shm_unlink(name);
+        mqtt_free(mux);
+        return NULL;
+    }
+
+    memset(mux->shm, 0, sizeof(mux_shm_t));
+    mux->shm->magic = MUX_MAGIC;
+    mux->shm->owner_pid = getpid();
+    atomic_store_explicit(&mux->shm->running, true, memory_order_release);
+
+    return mux;
+}
+
+/*
+ * Serves local client requests and waits up to timeout_ms for broker data.
+ * Returns number of requests and messages handled, or -1 on broker failure.
+ */
+int mqtt_mux_run_once(mqtt_mux *mux, int timeout_ms) {
+    int handled = 0, ret;
+    mux_msg_t msg;
+
+    for (int i = 0; i < MUX_MAX_CLIENTS; i++) {
+        mux_slot_t *slot = &mux->shm->slots[i];
+        uint32_t state;
+
+        state = atomic_load_explicit(&slot->state, memory_order_acquire);
+
+        // reap clients that died without detaching
+        if (state == MUX_ACTIVE && kill(slot->pid, 0) < 0 && errno == ESRCH &&
+            atomic_compare_exchange_strong(&slot->state, &state,
+                                           MUX_DETACHED))
+            state = MUX_DETACHED;
+
+        // only the owner resets the rings, fan_out may have been pushing to
+        // them for the client that left
+        if (state == MUX_DETACHED) {
+            client_drop(mux, i);
+            mqtt_free(mux->backlogs[i].msgs);
+            memset(&mux->backlogs[i], 0, sizeof(mux_backlog));
+            atomic_store_explicit(&slot->backlogged, 0, memory_order_relaxed);
+            atomic_store_explicit(&slot->dropped, 0, memory_order_relaxed);
+            atomic_store_explicit(&slot->reply_seq, 0, memory_order_relaxed);
+            mux->replies[i].seq = 0;
+            ring_reset(&slot->to_owner);
+            ring_reset(&slot->to_client);
+            atomic_fetch_add_explicit(&slot->generation, 1,
+                                      memory_order_relaxed);
+            atomic_store_explicit(&slot->state, MUX_FREE,
+                                  memory_order_release);
+            continue;
+        }
+        else if (state != MUX_ACTIVE) {
+            continue;
+        }
+
+        if (mux->backlogs[i].len > 0)
+            backlog_flush(mux, i);
+
+        while (ring_peek(&slot->to_owner, &msg) == 0) {
+            switch (msg.op) {
+            case MUX_PUB:
+                // acknowledgements come back through mqtt_poll, a QoS 1 or 2
+                // publish doesn't stall the other clients for a round trip
+                ret = mqtt_pub_async(mux->broker, msg.topic, msg.payload,
+                                     msg.retain, msg.dup, msg.qos);
+                // leave it in the ring, a full ring pushes back on the client
+                if (ret == MQTT_WOULDBLOCK) {
+                    goto next_client;
+                }
+                else if (ret > 0) {
+                    mux->pending++;
+                    reply_on_ack(mux, i, msg.seq,
+                                 (msg.qos == QOS1) ? PUBACK : PUBCOMP, ret);
+                }
+                else {
+                    client_reply(mux, i, msg.seq, ret);
+                }
+                break;
+            case MUX_SUB:
+                if ((ret = client_sub(mux, i, msg.topic, msg.qos)) > 0)
+                    reply_on_ack(mux, i, msg.seq, SUBACK, ret);
+                else
+                    client_reply(mux, i, msg.seq, ret);
+                break;
+            case MUX_UNSUB:
+                if ((ret = client_unsub(mux, i, msg.topic)) > 0)
+                    reply_on_ack(mux, i, msg.seq, UNSUBACK, ret);
+                else
+                    client_reply(mux, i, msg.seq, ret);
+                break;
+            default:
+                break;
+            }
+            ring_drop(&slot->to_owner);
+            handled++;
+        }
+next_client:
+        ;
+    }
+
+    /*
+     * Wait for broker data or client requests, don't wait if there were
+     * client requests
+     */
+    if (owner_wait(mux, handled > 0 ? 0 : timeout_ms) < 0) {
+        return -1;
+    }
+
+    mux->delivered = 0;
+    if (mqtt_poll(mux->broker, 0) < 0) {
+        return -1;
+    }
+    handled += mux->delivered;
+
+    return handled;
+}
+
+/*
+ * Stops multiplexing and removes the shared memory segment
+ */
+int mqtt_mux_destroy(mqtt_mux *mux) {
+    char path[MUX_WAKE_LEN];
+
+    if (mux == NULL) {
+        return -1;
+    }
+
+    atomic_store_explicit(&mux->shm->running, false, memory_order_release);
+    for (int i = 0; i < MUX_MAX_CLIENTS; i++) {
+        client_drop(mux, i);
+        client_wake(&mux->shm->slots[i]);
+        futex_wake(&mux->shm->slots[i].reply_seq);
+        mqtt_free(mux->backlogs[i].msgs);
+    }
+
+    // the broker goes back to the sync API, which can't take these acks
+    while (mux->pending > 0 &&
+           mqtt_poll(mux->broker, MUX_TIMEOUT_US / 1000) > 0)
+        ;
+    mqtt_set_callbacks(mux->broker, NULL, NULL, NULL);
+
+    wake_path(path, mux->name);
+    close(mux->wake_fd);
+    unlink(path);
+
+    munmap(mux->shm, sizeof(mux_shm_t));
+    shm_unlink(mux->name);
+    mqtt_free(mux);
+
+    return 0;
+}
+
+/*
+ * Client side
+ */
+
+/*
+ * Wakes the owner if it is blocked, after a request was queued
+ */
+static void owner_wake(mqtt_mux_client *client) {
+    // pairs with the fence in owner_wait
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&client->shm->owner_waiting,
+                             memory_order_relaxed) &&
+        atomic_exchange(&client->shm->owner_waiting, 0) &&
+        write(client->wake_fd, "", 1) < 0 && errno != EAGAIN) {
+        // a full FIFO already wakes the owner
+        if (VERBOSE)
+            fprintf(stderr, "Unable to wake multiplexer owner\n");
+    }
+}
+
+/*
+ * Attaches to a multiplexer created by another local process
+ */
+mqtt_mux_client *mqtt_mux_attach(const char *name) {
+    int fd;
+    mqtt_mux_client *client;
+    char path[MUX_WAKE_LEN];
+
+    if ((client = (mqtt_mux_client *)mqtt_malloc(sizeof(mqtt_mux_client)))
+        == NULL) {
+        return NULL;
+    }
+
+    if ((fd = shm_open(name, O_RDWR, 0600)) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to open shared memory\n");
+        mqtt_free(client);
+        return NULL;
+    }
+
+    if ((client->shm = mmap(NULL, sizeof(mux_shm_t), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        if (VERBOSE)
+            fprintf(stderr, "Unable to map shared memory\n");
+        close(fd);
+        mqtt_free(client);
+        return NULL;
+    }
+    close(fd);
+
+    wake_path(path, name);
+    if (client->shm->magic != MUX_MAGIC ||
+        !atomic_load_explicit(&client->shm->running, memory_order_acquire) ||
+        (client->wake_fd = open(path, O_WRONLY | O_NONBLOCK)) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Multiplexer not running\n");
+        munmap(client->shm, sizeof(mux_shm_t));
+        mqtt_free(client);
+        return NULL;
+    }
+
+    /*
+     * Claim a free slot
+     */
+    for (int i = 0; i < MUX_MAX_CLIENTS; i++) {
+        mux_slot_t *slot = &client->shm->slots[i];
+        uint32_t expected = MUX_FREE;
+
+        // free slots were reset by the owner
+        if (atomic_compare_exchange_strong(&slot->state, &expected,
+                                           MUX_CLAIMED)) {
+            slot->pid = getpid();
+            atomic_store_explicit(&slot->state, MUX_ACTIVE,
+                                  memory_order_release);
+
+            client->slot = slot;
+            client->slot_idx = i;
+            client->seq = 0;
+            return client;
+        }
+    }
+
+    if (VERBOSE)
+        fprintf(stderr, "No free multiplexer slots\n");
+    close(client->wake_fd);
+    munmap(client->shm, sizeof(mux_shm_t));
+    mqtt_free(client);
+    return NULL;
+}
+
+static int client_request(mqtt_mux_client *client, const mux_msg_t *msg) {
+    if (client == NULL ||
+        !atomic_load_explicit(&client->shm->running, memory_order_acquire)) {
+        if (VERBOSE)
+            fprintf(stderr, "Multiplexer not running\n");
+        return -1;
+    }
+
+    if (ring_push(&client->slot->to_owner, msg) < 0) {
+        if (VERBOSE)
+            fprintf(stderr, "Multiplexer request ring full\n");
+        return -1;
+    }
+
+    owner_wake(client);
+
+    return 0;
+}
+
+/*
+ * Queues a request and waits for the owner to answer it, returns the result
+ */
+static int client_call(mqtt_mux_client *client, mux_msg_t *msg) {
+    uint64_t deadline, now;
+    uint32_t seq;
+
+    if (client == NULL) {
+        return -1;
+    }
+
+    if (++client->seq == 0)
+        client->seq = 1;
+    msg->seq = client->seq;
+    if (client_request(client, msg) < 0) {
+        return -1;
+    }
+
+    // the owner wakes the futex after every reply
+    deadline = mono_us() + MUX_TIMEOUT_US;
+    while ((seq = atomic_load_explicit(&client->slot->reply_seq,
+                                       memory_order_acquire)) != msg->seq) {
+        now = mono_us();
+        if (!atomic_load_explicit(&client->shm->running,
+                                  memory_order_acquire) ||
+            now >= deadline) {
+            if (VERBOSE)
+                fprintf(stderr, "No reply from multiplexer\n");
+            return -1;
+        }
+        futex_wait(&client->slot->reply_seq, seq, deadline - now);
+    }
+
+    return client->slot->reply_status;
+}
+
+/*
+ * Publishes a message through the multiplexer. QoS 0 messages return once
+ * queued, QoS 1 and 2 ones once the broker acknowledged them to the owner.
+ */
+int mqtt_mux_pub(mqtt_mux_client *client,
+                 const char *topic, const char *msg,
+                 bool retain, bool dup, mqtt_qos_t qos) {
+    mux_msg_t req;
+
+    if (msg_fill(&req, MUX_PUB, topic, msg, retain, dup, qos) < 0) {
+        return -1;
+    }
+
+    if (qos == QOS0) {
+        return client_request(client, &req);
+    }
+    return (client_call(client, &req) < 0) ? -1 : 0;
+}
+
+/*
+ * Subscribes to a topic through the multiplexer, returns once the broker
+ * granted the subscription
+ */
+int mqtt_mux_sub(mqtt_mux_client *client, const char *topic, mqtt_qos_t qos) {
+    mux_msg_t req;
+
+    if (msg_fill(&req, MUX_SUB, topic, NULL, false, false, qos) < 0) {
+        return -1;
+    }
+
+    return (client_call(client, &req) < 0) ? -1 : 0;
+}
+
+/*
+ * Unsubscribes to a topic through the multiplexer, returns once the broker
+ * acknowledged it
+ */
+int mqtt_mux_unsub(mqtt_mux_client *client, const char *topic) {
+    mux_msg_t req;
+
+    if (msg_fill(&req, MUX_UNSUB, topic, NULL, false, false, QOS0) < 0) {
+        return -1;
+    }
+
+    return (client_call(client, &req) < 0) ? -1 : 0;
+}
+
+/*
+ * Get data of subscribed topics, waits up to the broker recv timeout
+ */
+int mqtt_mux_get_data(mqtt_mux_client *client, mqtt_data_t *data) {
+    mux_slot_t *slot;
+    mux_msg_t msg;
+    uint64_t deadline, now;
+    uint32_t tail;
+
+    if (client == NULL) {
+        return -1;
+    }
+
+    slot = client->slot;
+    deadline = mono_us() + MUX_TIMEOUT_US;
+    while (ring_pop(&slot->to_client, &msg) < 0) {
+        now = mono_us();
+        if (!atomic_load_explicit(&client->shm->running,
+                                  memory_order_acquire) ||
+            now >= deadline) {
+            if (VERBOSE)
+                fprintf(stderr, "Receive data failure\n");
+            return -1;
+        }
+
+        // the owner checks waiting after pushing or stopping, so a message
+        // pushed after the tail is read below always wakes the futex
+        atomic_store_explicit(&slot->waiting, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        tail = atomic_load_explicit(&slot->to_client.tail,
+                                    memory_order_relaxed);
+        if (tail == atomic_load_explicit(&slot->to_client.head,
+                                         memory_order_relaxed) &&
+            atomic_load_explicit(&client->shm->running, memory_order_relaxed))
+            futex_wait(&slot->to_client.tail, tail, deadline - now);
+        atomic_store_explicit(&slot->waiting, 0, memory_order_relaxed);
+    }
+
+    // the owner waits for room to move held deliveries, pairs with the
+    // fence in owner_wait
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&slot->backlogged, memory_order_relaxed))
+        owner_wake(client);
+
+    data->qos = msg.qos;
+    data->retain = msg.retain;
+    data->msg_id = -1; // the owner already acknowledged the message
+    data->topic_len = msg.topic_len;
+    data->payload_len = msg.payload_len;
+    memcpy(data->topic, msg.topic, msg.topic_len + 1);
+    memcpy(data->payload, msg.payload, msg.payload_len);
+
+    return msg.topic_len + msg.payload_len;
+}
+
+/*
+ * Returns number of deliveries lost because the client fell behind since
+ * the last call
+ */
+int mqtt_mux_dropped(mqtt_mux_client *client) {
+    if (client == NULL) {
+        return -1;
+    }
+
+    return atomic_exchange(&client->slot->dropped, 0);
+}
+
+/*
+ * Releases the client slot, the owner frees it once it dropped the
+ * subscriptions and reset the rings
+ */
+int mqtt_mux_detach(mqtt_mux_client *client) {
+    if (client == NULL) {
+        return -1;
+    }
+
+    atomic_store_explicit(&client->slot->state, MUX_DETACHED,
+                          memory_order_release);
+    owner_wake(client);
+    close(client->wake_fd);
+    munmap(client->shm, sizeof(mux_shm_t));
+    mqtt_free(client);
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+#ifndef MQTT_MUX_H
+#define MQTT_MUX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+
+#include "mqtt.h"
+
+/*
+ * Local multiplexer: one owner process holds the mqtt_broker connection,
+ * co-located processes publish and subscribe through shared memory.
+ */
+
+#define MUX_NAME_LEN        32      // shm name, must start with '/'
+#define MUX_WAKE_LEN        (MUX_NAME_LEN + 16)
+#define MUX_MAX_CLIENTS     64
+#define MUX_RING_SLOTS      64      // must be a power of two
+#define MUX_MAX_SUBS        16      // subscriptions per local client
+#define MUX_BACKLOG_LEN     1024    // QoS 1 and 2 deliveries held for a
+                                    // client whose ring is full
+
+/* Ring buffer operations */
+typedef enum {
+    MUX_PUB,
+    MUX_SUB,
+    MUX_UNSUB,
+    MUX_DATA
+} mux_op_t;
+
+/* Ring buffer slot */
+typedef struct {
+    uint8_t op;
+    uint8_t qos;
+    bool retain;
+    bool dup;
+    uint32_t seq;                   // request waiting for a reply, 0 if none
+    uint16_t topic_len;
+    uint16_t payload_len;
+    char topic[MAXPACKET_LEN];
+    char payload[MAXPACKET_LEN];
+} mux_msg_t;
+
+/*
+ * Single producer, single consumer lock-free ring.
+ * head is only written by the consumer, tail only by the producer.
+ */
+typedef struct {
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    mux_msg_t slots[MUX_RING_SLOTS];
+} mux_ring_t;
+
+/*
+ * Client slot states. A detached slot is reset by the owner before it is
+ * free again, so attaching processes never touch rings the owner uses.
+ */
+typedef enum { MUX_FREE, MUX_CLAIMED, MUX_ACTIVE, MUX_DETACHED } mux_state_t;
+
+/* Per local client region of the shared segment */
+typedef struct {
+    _Atomic uint32_t state;
+    _Atomic uint32_t generation;    // bumped every time the slot is reset
+    pid_t pid;
+    _Atomic uint32_t waiting;       // client blocked on to_client.tail
+    _Atomic uint32_t backlogged;    // owner holds deliveries for to_client
+    _Atomic uint32_t dropped;       // deliveries lost to a full to_client
+    _Atomic uint32_t reply_seq;     // last request the owner answered
+    int32_t reply_status;           // its result, written before reply_seq
+    mux_ring_t to_owner;            // client -> owner requests
+    mux_ring_t to_client;           // owner -> client deliveries
+} mux_slot_t;
+
+/* Shared segment layout */
+typedef struct {
+    uint32_t magic;
+    pid_t owner_pid;
+    _Atomic bool running;
+    _Atomic uint32_t owner_waiting; // owner blocked, clients have to wake it
+    mux_slot_t slots[MUX_MAX_CLIENTS];
+} mux_shm_t;
+
+/* Owner side subscription bookkeeping (process local) */
+typedef struct {
+    int num_subs;
+    mqtt_qos_t sub_qos[MUX_MAX_SUBS];
+    uint16_t replay_ids[MUX_MAX_SUBS];  // SUBSCRIBE whose retained values
+                                        // go to the client, 0 if none
+    char subs[MUX_MAX_SUBS][MAXPACKET_LEN];
+} mux_client_subs;
+
+/*
+ * Owner side deliveries waiting for room in a client ring (process local),
+ * allocated while the client is behind
+ */
+typedef struct {
+    mux_msg_t *msgs;
+    int head;
+    int len;
+} mux_backlog;
+
+/* Owner side request waiting for the broker to acknowledge it */
+typedef struct {
+    uint32_t seq;                   // 0 if none
+    control_packet_t ack;
+    uint16_t packet_id;
+} mux_reply;
+
+/* Multiplexer owner */
+typedef struct {
+    mqtt_broker *broker;
+    mux_shm_t *shm;
+    char name[MUX_NAME_LEN];
+    int wake_fd;                    // read end of the wakeup FIFO
+    mux_client_subs clients[MUX_MAX_CLIENTS];
+    mux_backlog backlogs[MUX_MAX_CLIENTS];
+    mux_reply replies[MUX_MAX_CLIENTS];
+    int pending;                    // acknowledgements the broker owes
+    int delivered;                  // messages fanned out by this poll
+} mqtt_mux;
+
+/* Multiplexer client */
+typedef struct {
+    mux_shm_t *shm;
+    mux_slot_t *slot;
+    int slot_idx;
+    int wake_fd;                    // write end of the wakeup FIFO
+    uint32_t seq;                   // last request that wanted a reply
+} mqtt_mux_client;
+
+mqtt_mux *mqtt_mux_create(const char *name, mqtt_broker *broker);
+int mqtt_mux_run_once(mqtt_mux *mux, int timeout_ms);
+int mqtt_mux_destroy(mqtt_mux *mux);
+
+mqtt_mux_client *mqtt_mux_attach(const char *name);
+int mqtt_mux_pub(mqtt_mux_client *client,
+                 const char *topic, const char *msg,
+                 bool retain, bool dup, mqtt_qos_t qos);
+int mqtt_mux_sub(mqtt_mux_client *client, const char *topic, mqtt_qos_t qos);
+int mqtt_mux_unsub(mqtt_mux_client *client, const char *topic);
+int mqtt_mux_get_data(mqtt_mux_client *client, mqtt_data_t *data);
+int mqtt_mux_dropped(mqtt_mux_client *client);
+int mqtt_mux_detach(mqtt_mux_client *client);
+
+#endif // MQTT_MUX_H
@@ -0,0 +1,92 @@
+/*
+ * Slab allocator for the MQTT publish and subscribe client.
+ * Written by Edward Lu
+ */
+
+#include "mqtt_pool.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <string.h>
+
+#define SLAB_ALIGN  16
+
+/* Small helper functions */
+static size_t align_up(size_t len) {
+    return (len + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+/*
+ * Sets up a slab allocator of objects of obj_size bytes
+ */
+void mqtt_slab_init(mqtt_slab *slab, size_t obj_size, int objs_per_slab) {
+    slab->obj_size = align_up(obj_size);
+    slab->objs_per_slab = (objs_per_slab > 0) ? objs_per_slab : 1;
+    slab->slabs = NULL;
+    slab->free_list = NULL;
+    slab->in_use = 0;
+}
+
+/*
+ * Allocates another slab and puts its objects on the free list
+ */
+static int slab_grow(mqtt_slab *slab) {
+    // first SLAB_ALIGN bytes link the slabs, objects follow
+    char *mem = (char *)mqtt_malloc(SLAB_ALIGN +
+                                    slab->obj_size * slab->objs_per_slab);
+
+    if (mem == NULL) {
+        return -1;
+    }
+    *(void **)mem = slab->slabs;
+    slab->slabs = mem;
+
+    // push in reverse so objects are handed out in address order
+    for (int i = slab->objs_per_slab - 1; i >= 0; i--) {
+        void *obj = mem + SLAB_ALIGN + i * slab->obj_size;
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns a zeroed object, NULL if out of memory
+ */
+void *mqtt_slab_alloc(mqtt_slab *slab) {
+    void *obj;
+
+    if (slab->free_list == NULL && slab_grow(slab) < 0) {
+        return NULL;
+    }
+
+    obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    slab->in_use++;
+    memset(obj, 0, slab->obj_size);
+
+    return obj;
+}
+
+void mqtt_slab_free(mqtt_slab *slab, void *obj) {
+    if (obj != NULL) {
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+        slab->in_use--;
+    }
+}
+
+/*
+ * Releases all slabs, objects still in use become invalid
+ */
+void mqtt_slab_destroy(mqtt_slab *slab) {
+    while (slab->slabs != NULL) {
+        void *next = *(void **)slab->slabs;
+        mqtt_free(slab->slabs);
+        slab->slabs = next;
+    }
+    slab->free_list = NULL;
+    slab->in_use = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef MQTT_POOL_H
+#define MQTT_POOL_H
+
+#include <stddef.h>
+
+#include "mqtt.h"
+
+/*
+ * Slab allocator for fixed size objects.
+ * Objects are carved out of slabs holding objs_per_slab objects each. Freed
+ * objects go on a free list and are reused before another slab is
+ * allocated, slabs are only released when the allocator is destroyed.
+ * Not thread safe, use one pool per thread.
+ */
+
+typedef struct {
+    size_t obj_size;
+    int objs_per_slab;
+    void *slabs;                // allocated slabs, linked through first word
+    void *free_list;            // free objects, linked through first word
+    size_t in_use;
+} mqtt_slab;
+
+/* Connection pool, brokers and their async API state come from slabs */
+struct mqtt_pool {
+    mqtt_slab brokers;
+    mqtt_slab ios;
+};
+
+void mqtt_slab_init(mqtt_slab *slab, size_t obj_size, int objs_per_slab);
+void *mqtt_slab_alloc(mqtt_slab *slab);
+void mqtt_slab_free(mqtt_slab *slab, void *obj);
+void mqtt_slab_destroy(mqtt_slab *slab);
+
+#endif // MQTT_POOL_H
@@ -0,0 +1,312 @@
+/*
+ * Replays the outbound traffic of a capture file against a broker.
+ * Written by Edward Lu
+ *
+ * usage: mqtt_replay <capture> [host] [port] [speed]
+ *
+ * speed 1 plays the packets at the captured pace, 2 twice as fast and so
+ * on, 0 plays them as fast as possible. Acknowledgements in the capture are
+ * skipped, the client sends its own.
+ */
+
+#include "mqtt.h"
+#include "mqtt_capture.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <string.h>
+
+#define DEFAULT_HOST    "127.0.0.1"
+#define DEFAULT_PORT    1883
+#define DRAIN_TIMEOUT_MS    5000    // wait for acks at the end
+
+/* Counters of the replay */
+typedef struct {
+    int packets;
+    int pubs;
+    uint64_t payload_bytes;
+    int expected_acks;
+    int acks;
+    int msgs;
+} replay_stats;
+
+/* Small helper functions */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint16_t read_u16(const uint8_t *buf) {
+    return (buf[0] << 8) | buf[1];
+}
+
+static void on_msg(mqtt_broker *broker, const mqtt_data_t *data, void *arg) {
+    ((replay_stats *)arg)->msgs++;
+}
+
+static void on_ack(mqtt_broker *broker, control_packet_t type,
+                   uint16_t packet_id, int status, void *arg) {
+    ((replay_stats *)arg)->acks++;
+}
+
+/*
+ * Finds the variable header of a captured packet, returns its length or
+ * -1 if the packet is malformed
+ */
+static int packet_body(const capture_rec *rec, const uint8_t **body) {
+    const uint8_t *pkt = (const uint8_t *)(rec + 1);
+    uint32_t remaining_len = 0, mult = 1;
+    uint32_t off = 1;
+
+    do {
+        if (off >= rec->len || off > 4)
+            return -1;
+        remaining_len += (pkt[off] & 0x7f) * mult;
+        mult *= 128;
+    } while (pkt[off++] & 0x80);
+
+    if (off + remaining_len > rec->len) {
+        return -1;
+    }
+    *body = &pkt[off];
+
+    return remaining_len;
+}
+
+/*
+ * Copies a length prefixed string of a packet, returns bytes consumed or
+ * -1 if it doesn't fit
+ */
+static int read_str(const uint8_t *buf, int avail, char *str, int size) {
+    int len;
+
+    if (avail < 2 || (len = read_u16(buf)) + 2 > avail || len >= size) {
+        return -1;
+    }
+    memcpy(str, &buf[2], len);
+    str[len] = '\0';
+
+    return 2 + len;
+}
+
+/*
+ * Connects with the client id and flags of the first captured CONNECT
+ */
+static mqtt_broker *replay_connect(mqtt_capture *cap, const char *host,
+                                   uint16_t port) {
+    char client_id[CLIENTID_LEN] = "mqtt_replay";
+    uint8_t flags = CLEAN_SESSION, keep_alive = 60;
+    const capture_rec *rec;
+    const uint8_t *body;
+    mqtt_broker *broker;
+    size_t off = 0;
+    int len;
+
+    while ((rec = mqtt_capture_next(cap, &off)) != NULL) {
+        const uint8_t *pkt = (const uint8_t *)(rec + 1);
+        if (rec->dir != CAPTURE_OUT || (pkt[0] >> 4) != CONNECT)
+            continue;
+
+        // protocol name (6) + level (1) + flags (1) + keep alive (2)
+        if ((len = packet_body(rec, &body)) >= 10) {
+            // will, username and password aren't in the capture's control
+            flags = body[7] & CLEAN_SESSION;
+            keep_alive = (read_u16(&body[8]) > 255) ? 255 : body[9];
+            read_str(&body[10], len - 10, client_id, CLIENTID_LEN);
+        }
+        break;
+    }
+
+    if ((broker = mqtt_init(host, client_id, port)) == NULL ||
+        mqtt_connect(broker, flags, keep_alive) < 0) {
+        return NULL;
+    }
+
+    return broker;
+}
+
+/*
+ * Sends one captured packet through the async API
+ */
+static int replay_packet(mqtt_broker *broker, const capture_rec *rec,
+                         replay_stats *stats) {
+    const uint8_t *pkt = (const uint8_t *)(rec + 1);
+    control_packet_t type = pkt[0] >> 4;
+    mqtt_qos_t qos = (pkt[0] >> 1) & 0b11;
+    char topic[MAXPACKET_LEN];
+    const uint8_t *body;
+    int len, off, ret;
+
+    if ((len = packet_body(rec, &body)) < 0) {
+        fprintf(stderr, "Malformed packet in capture\n");
+        return -1;
+    }
+
+    switch (type) {
+    case PUBLISH: {
+        if ((off = read_str(body, len, topic, sizeof(topic))) < 0)
+            return -1;
+        off += (qos != QOS0) ? 2 : 0;
+        if (off > len)
+            return -1;
+
+        // the API takes C strings, keep the size of binary payloads
+        char *msg = (char *)malloc(len - off + 1);
+        if (msg == NULL)
+            return -1;
+        for (int i = 0; i < len - off; i++)
+            msg[i] = body[off + i] ? body[off + i] : ' ';
+        msg[len - off] = '\0';
+
+        ret = mqtt_pub_async(broker, topic, msg, pkt[0] & 1, false, qos);
+        free(msg);
+        if (ret < 0)
+            return -1;
+
+        stats->pubs++;
+        stats->payload_bytes += len - off;
+        stats->expected_acks += (qos != QOS0);
+        break;
+    }
+    case SUBSCRIBE:
+    case UNSUBSCRIBE:
+        // packet identifier, then the topic filters
+        for (off = 2; off < len; ) {
+            if ((ret = read_str(&body[off], len - off, topic,
+                                sizeof(topic))) < 0)
+                return -1;
+            off += ret;
+            if (type == SUBSCRIBE) {
+                if (off >= len)
+                    return -1;
+                ret = mqtt_sub_async(broker, topic, body[off++] & 0b11);
+            }
+            else {
+                ret = mqtt_unsub_async(broker, topic);
+            }
+            if (ret < 0)
+                return -1;
+            stats->expected_acks++;
+        }
+        break;
+    case PINGREQ:
+        if (mqtt_ping_async(broker) < 0)
+            return -1;
+        stats->expected_acks++;
+        break;
+    default:
+        // CONNECT was replayed by replay_connect, the client sends its
+        // own acknowledgements
+        return 0;
+    }
+
+    stats->packets++;
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *host = DEFAULT_HOST;
+    uint16_t port = DEFAULT_PORT;
+    double speed = 1;
+    replay_stats stats;
+    mqtt_capture *cap;
+    mqtt_broker *broker;
+    const capture_rec *rec;
+    uint64_t start, first_ts = 0;
+    size_t off = 0;
+    bool first = true;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <capture> [host] [port] [speed]\n",
+                argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        host = argv[2];
+    if (argc > 3)
+        port = atoi(argv[3]);
+    if (argc > 4 && (speed = atof(argv[4])) < 0) {
+        fprintf(stderr, "Invalid speed\n");
+        return 1;
+    }
+
+    if ((cap = mqtt_capture_map(argv[1])) == NULL) {
+        return 1;
+    }
+
+    if ((broker = replay_connect(cap, host, port)) == NULL) {
+        fprintf(stderr, "Unable to connect to %s:%d\n", host, port);
+        mqtt_capture_close(cap);
+        return 1;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    mqtt_set_callbacks(broker, on_msg, on_ack, &stats);
+
+    start = now_ns();
+    while ((rec = mqtt_capture_next(cap, &off)) != NULL) {
+        const uint8_t *pkt = (const uint8_t *)(rec + 1);
+
+        if (rec->dir != CAPTURE_OUT) {
+            continue;
+        }
+        else if ((pkt[0] >> 4) == DISCONNECT) {
+            break;
+        }
+
+        // keep the captured spacing, scaled by speed
+        if (first) {
+            first_ts = rec->ts_ns;
+            first = false;
+        }
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)((rec->ts_ns - first_ts) / speed);
+            uint64_t now;
+            while ((now = now_ns()) < due) {
+                if (mqtt_poll(broker, (due - now) / 1000000) < 0)
+                    goto fail;
+            }
+        }
+        else if (mqtt_poll(broker, 0) < 0) {
+            goto fail;
+        }
+
+        if (replay_packet(broker, rec, &stats) < 0) {
+            fprintf(stderr, "Unable to replay packet\n");
+            goto fail;
+        }
+    }
+
+    // wait for the broker to acknowledge what was sent
+    for (uint64_t deadline = now_ns() + DRAIN_TIMEOUT_MS * 1000000ull;
+         (stats.acks < stats.expected_acks || mqtt_want_write(broker)) &&
+         now_ns() < deadline; ) {
+        if (mqtt_poll(broker, 100) < 0)
+            goto fail;
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("%d packets, %d publishes (%llu payload bytes) in %.3f sec, "
+           "%.0f msg/sec\n", stats.packets, stats.pubs,
+           (unsigned long long)stats.payload_bytes, elapsed,
+           (elapsed > 0) ? stats.pubs / elapsed : 0);
+    printf("%d/%d acknowledged, %d messages received\n",
+           stats.acks, stats.expected_acks, stats.msgs);
+
+    mqtt_disconnect(broker);
+    free_broker(broker);
+    mqtt_capture_close(cap);
+
+    return (stats.acks == stats.expected_acks) ? 0 : 1;
+
+fail:
+    free_broker(broker);
+    mqtt_capture_close(cap);
+    return 1;
+}
@@ -0,0 +1,141 @@
+/*
+ * Static tracepoints on the packet paths of the MQTT client.
+ * Written by Edward Lu
+ */
+
+#ifndef MQTT_TRACE_H
+#define MQTT_TRACE_H
+
+/*
+ * USDT probes of provider mqtt, a nop instruction each until a tracer
+ * attaches. All probes take the same arguments:
+ *
+ *   arg0   control packet type
+ *   arg1   packet identifier, 0 if the packet has none
+ *   arg2   topic length, 0 if the packet has no topic
+ *   arg3   byte count
+ *
+ * encode   packet built and handed to the outbound queue
+ * send     bytes the socket took, for the packet at the start of the send
+ * recv     bytes read from the socket, for the first packet not yet decoded
+ * decode   incoming packet parsed
+ * ack      acknowledgement matched to a packet that was sent
+ * callback async API callback about to be called
+ *
+ * e.g. bpftrace -e 'usdt:./mqtt_test:mqtt:send { @[arg0] = hist(arg3); }'
+ *
+ * The probes need <sys/sdt.h> (systemtap-sdt-dev), without it or with
+ * MQTT_NO_USDT defined they compile to nothing. Each probe has a semaphore
+ * the tracer raises while attached, packets are only parsed for the probe
+ * arguments then.
+ */
+#if !defined(MQTT_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define MQTT_USDT
+#endif
+#endif
+
+#ifdef MQTT_USDT
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt.h"
+
+/* Probe semaphores, defined once in mqtt.c with MQTT_TRACE_SEMAPHORE */
+#define MQTT_TRACE_SEMAPHORE(probe) \
+    volatile unsigned short mqtt_##probe##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes")))
+
+extern volatile unsigned short mqtt_encode_semaphore;
+extern volatile unsigned short mqtt_send_semaphore;
+extern volatile unsigned short mqtt_recv_semaphore;
+extern volatile unsigned short mqtt_decode_semaphore;
+extern volatile unsigned short mqtt_ack_semaphore;
+extern volatile unsigned short mqtt_callback_semaphore;
+
+#define MQTT_TRACE_ENABLED(probe) \
+    __builtin_expect(mqtt_##probe##_semaphore != 0, 0)
+
+/* Fields of an encoded packet the probes report */
+typedef struct {
+    uint8_t type;
+    uint16_t packet_id;
+    uint16_t topic_len;
+} mqtt_trace_info;
+
+/*
+ * Reads type, packet identifier and topic length from the first len bytes
+ * of an encoded packet, fields past len are left 0
+ */
+static inline mqtt_trace_info mqtt_trace_parse(const char *pkt, size_t len) {
+    mqtt_trace_info info = { 0, 0, 0 };
+    size_t off = 1;
+    uint8_t qos;
+
+    if (len < 2) {
+        return info;
+    }
+    info.type = ((uint8_t)pkt[0] >> 4) & 0xf;
+    qos = ((uint8_t)pkt[0] >> 1) & 0b11;
+
+    // skip remaining length
+    while (off < len && off < 5 && ((uint8_t)pkt[off] & 0x80))
+        off++;
+    off++;
+
+    switch (info.type) {
+    case PUBLISH:
+        if (off + 2 > len)
+            break;
+        info.topic_len = ((uint8_t)pkt[off] << 8) | (uint8_t)pkt[off + 1];
+        off += 2 + info.topic_len;
+        if (qos != 0 && off + 2 <= len)
+            info.packet_id = ((uint8_t)pkt[off] << 8) |
+                             (uint8_t)pkt[off + 1];
+        break;
+    case SUBSCRIBE:
+    case UNSUBSCRIBE:
+        if (off + 4 <= len)
+            info.topic_len = ((uint8_t)pkt[off + 2] << 8) |
+                             (uint8_t)pkt[off + 3];
+        // fall through
+    case PUBACK:
+    case PUBREC:
+    case PUBREL:
+    case PUBCOMP:
+    case SUBACK:
+    case UNSUBACK:
+        if (off + 2 <= len)
+            info.packet_id = ((uint8_t)pkt[off] << 8) |
+                             (uint8_t)pkt[off + 1];
+        break;
+    default:
+        break;
+    }
+
+    return info;
+}
+
+#define MQTT_TRACE(probe, type, packet_id, topic_len, bytes) \
+    DTRACE_PROBE4(mqtt, probe, type, packet_id, topic_len, bytes)
+
+/* Probe with the fields parsed from an encoded packet, if traced */
+#define MQTT_TRACE_PKT(probe, pkt, len, bytes) do { \
+    if (MQTT_TRACE_ENABLED(probe)) { \
+        mqtt_trace_info _info = mqtt_trace_parse(pkt, len); \
+        DTRACE_PROBE4(mqtt, probe, _info.type, _info.packet_id, \
+                      _info.topic_len, bytes); \
+    } \
+} while (0)
+
+#else
+
+#define MQTT_TRACE(probe, type, packet_id, topic_len, bytes) do { } while (0)
+#define MQTT_TRACE_PKT(probe, pkt, len, bytes) do { } while (0)
+
+#endif // MQTT_USDT
+
+#endif // MQTT_TRACE_H